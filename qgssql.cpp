@@ -147,6 +147,14 @@ void DFSVisitor::visit( const Select& s )
     if ( s.where() ) {
         s.where()->accept(*this);
     }
+    if ( s.groupBy() ) {
+        if ( s.groupBy()->expressions() ) {
+            s.groupBy()->expressions()->accept(*this);
+        }
+        if ( s.groupBy()->having() && s.groupBy()->having()->expression() ) {
+            s.groupBy()->having()->expression()->accept(*this);
+        }
+    }
 }
 
 void DFSVisitor::visit( const SelectStmt& s )
@@ -341,6 +349,148 @@ QList<QString> referencedTables( const Node& n )
     return tv.tables.toList();
 }
 
+class SridVisitor : public DFSVisitor
+{
+public:
+    SridVisitor() : DFSVisitor() {}
+
+    virtual void visit( const ExpressionFunction& f ) override
+    {
+        // position of the SRID argument
+        QString name = f.name().toLower();
+        int nargs = f.args() ? f.args()->count() : 0;
+        int pos = -1;
+        if ( name == "transform" || name == "st_transform" || name == "setsrid" || name == "st_setsrid" ||
+             name == "geomfromtext" || name == "st_geomfromtext" || name == "geomfromwkb" || name == "st_geomfromwkb" ) {
+            pos = 1;
+        }
+        else if ( name == "makepoint" && nargs == 3 ) {
+            pos = 2;
+        }
+        else if ( name == "buildmbr" && nargs == 5 ) {
+            pos = 4;
+        }
+        if ( pos != -1 && pos < nargs ) {
+            const Node* arg = ( f.args()->begin() + pos )->data();
+            if ( arg->type() == Node::NODE_EXPRESSION_LITERAL ) {
+                QVariant v = static_cast<const ExpressionLiteral*>( arg )->value();
+                if ( v.type() == QVariant::Int ) {
+                    srids.insert( v.toInt() );
+                }
+            }
+        }
+        DFSVisitor::visit( f );
+    }
+
+    QSet<long> srids;
+};
+
+QList<long> referencedSrids( const Node& n )
+{
+    SridVisitor sv;
+    n.accept(sv);
+    return sv.srids.toList();
+}
+
+class AggregateVisitor : public DFSVisitor
+{
+public:
+    AggregateVisitor() : DFSVisitor(), found(false) {}
+
+    virtual void visit( const ExpressionFunction& f ) override
+    {
+        QString name = f.name().toLower();
+        int nargs = f.args() ? f.args()->count() : 0;
+        if ( name == "count" || name == "sum" || name == "total" || name == "avg" || name == "group_concat" ||
+             name == "gunion" || name == "collect" || name == "extent" || name == "st_extent" || name == "polygonize" || name == "st_polygonize" ) {
+            found = true;
+        }
+        // these ones are scalar functions when called with several arguments
+        else if ( nargs == 1 && (name == "min" || name == "max" || name == "st_union" || name == "st_collect" || name == "makeline" || name == "st_makeline") ) {
+            found = true;
+        }
+        DFSVisitor::visit( f );
+    }
+
+    // aggregates in sub queries do not aggregate rows of the outer query
+    virtual void visit( const ExpressionSubQuery& ) override {}
+
+    bool found;
+};
+
+bool isRowPreserving( const Node& n, QString& table )
+{
+    if ( n.type() != Node::NODE_SELECT_STMT ) {
+        return false;
+    }
+    const SelectStmt& stmt = static_cast<const SelectStmt&>( n );
+    if ( stmt.limitOffset() || !stmt.selects() || stmt.selects()->count() != 1 ) {
+        return false;
+    }
+    const Node* first = stmt.selects()->begin()->data();
+    if ( first->type() != Node::NODE_SELECT ) {
+        return false;
+    }
+    const Select& select = static_cast<const Select&>( *first );
+    if ( select.where() || select.groupBy() || select.isDistinct() || !select.from() || !select.columnList() ) {
+        return false;
+    }
+
+    // a single table
+    if ( select.from()->type() != Node::NODE_LIST ) {
+        return false;
+    }
+    const List* from = static_cast<const List*>( select.from() );
+    if ( from->count() != 1 || (*from->begin())->type() != Node::NODE_TABLE_NAME ) {
+        return false;
+    }
+
+    AggregateVisitor av;
+    select.columnList()->accept( av );
+    if ( av.found ) {
+        return false;
+    }
+
+    table = static_cast<const TableName*>( from->begin()->data() )->name();
+    return true;
+}
+
+QList<ColumnLineage> columnLineage( const Node& n, const TableDefs& tableContext )
+{
+    QList<ColumnLineage> lineage;
+    QString table;
+    if ( !isRowPreserving( n, table ) ) {
+        return lineage;
+    }
+    const SelectStmt& stmt = static_cast<const SelectStmt&>( n );
+    const Select* select = static_cast<const Select*>( stmt.selects()->begin()->data() );
+    const List* from = static_cast<const List*>( select->from() );
+    QString alias = static_cast<const TableName*>( from->begin()->data() )->alias();
+
+    const List* columns = static_cast<const List*>( select->columnList() );
+    for ( auto it = columns->begin(); it != columns->end(); it++ ) {
+        if ( (*it)->type() == Node::NODE_ALL_COLUMNS ) {
+            foreach ( const ColumnType& c, tableContext.value( table ) ) {
+                lineage << ColumnLineage( c.name(), table, c.name() );
+            }
+        }
+        else if ( (*it)->type() == Node::NODE_COLUMN_EXPRESSION ) {
+            const ColumnExpression* c = static_cast<const ColumnExpression*>( it->data() );
+            const Expression* e = c->expression();
+            if ( e && e->type() == Node::NODE_TABLE_COLUMN ) {
+                const TableColumn* tc = static_cast<const TableColumn*>( e );
+                QString t = tc->table().toLower();
+                if ( t.isEmpty() || t == table.toLower() || t == alias.toLower() ) {
+                    lineage << ColumnLineage( c->alias().isEmpty() ? tc->column() : c->alias(), table, tc->column() );
+                    continue;
+                }
+            }
+            lineage << ColumnLineage( c->alias() );
+        }
+    }
+    return lineage;
+}
+
 class InfererException
 {
 public:
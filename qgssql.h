@@ -409,20 +409,55 @@ namespace QgsSql
         QScopedPointer<List> mUsingColumns;
     };
 
+    class Having : public Node
+    {
+    public:
+        Having( Expression* expr ) :
+            Node(NODE_HAVING),
+            mExpr(expr)
+        {}
+
+        const Expression* expression() const { return mExpr.data(); }
+
+        virtual void accept( NodeVisitor& v ) const;
+    private:
+        QScopedPointer<Expression> mExpr;
+    };
+
+    class GroupBy : public Node
+    {
+    public:
+        GroupBy( List* exp, Having* having = 0 ) :
+            Node(NODE_GROUP_BY),
+            mExp(exp),
+            mHaving(having)
+        {}
+
+        const List* expressions() const { return mExp.data(); }
+        const Having* having() const { return mHaving.data(); }
+
+        virtual void accept( NodeVisitor& v ) const;
+    private:
+        QScopedPointer<List> mExp;
+        QScopedPointer<Having> mHaving;
+    };
+
     class Select : public Node
     {
     public:
-        Select( Node* column_list, Node* from, Expression* where, bool is_distinct = false ) :
+        Select( Node* column_list, Node* from, Expression* where, bool is_distinct = false, GroupBy* group_by = 0 ) :
             Node(NODE_SELECT),
             mColumnList(column_list),
             mFrom(from),
             mWhere(where),
-            mIsDistinct(is_distinct)
+            mIsDistinct(is_distinct),
+            mGroupBy(group_by)
         {}
 
         const Node* columnList() const { return mColumnList.data(); }
         const Node* from() const { return mFrom.data(); }
         const Expression* where() const { return mWhere.data(); }
+        const GroupBy* groupBy() const { return mGroupBy.data(); }
 
         bool isDistinct() const { return mIsDistinct; }
 
@@ -431,6 +466,7 @@ namespace QgsSql
         QScopedPointer<Node> mColumnList, mFrom;
         QScopedPointer<Expression> mWhere;
         bool mIsDistinct;
+        QScopedPointer<GroupBy> mGroupBy;
     };
 
     class CompoundSelect : public Node
@@ -459,38 +495,6 @@ namespace QgsSql
     };
 
 
-    class Having : public Node
-    {
-    public:
-        Having( Expression* expr ) :
-            Node(NODE_HAVING),
-            mExpr(expr)
-        {}
-
-        const Expression* expression() const { return mExpr.data(); }
-
-        virtual void accept( NodeVisitor& v ) const;
-    private:
-        QScopedPointer<Expression> mExpr;
-    };
-
-    class GroupBy : public Node
-    {
-    public:
-        GroupBy( List* exp, Having* having = 0 ) : 
-            Node(NODE_GROUP_BY),
-            mExp(exp)
-        {}
-
-        const List* expressions() const { return mExp.data(); }
-        const Having* having() const { return mHaving.data(); }
-
-        virtual void accept( NodeVisitor& v ) const;
-    private:
-        QScopedPointer<List> mExp;
-        QScopedPointer<Having> mHaving;
-    };
-
     class LimitOffset : public Node
     {
     public:
@@ -634,6 +638,19 @@ QString asString( const QgsSql::Node& );
  */
 QList<QString> referencedTables( const QgsSql::Node& );
 
+/**
+ * Get a list of reference systems used in the query: integer literals passed as SRID
+ * to spatialite functions, as in Transform(geometry, 2154)
+ */
+QList<long> referencedSrids( const QgsSql::Node& );
+
+/**
+ * Whether the query returns one row for each row of a single table, i.e. a SELECT
+ * from one table without WHERE, GROUP BY, DISTINCT, LIMIT or aggregate function
+ * @param table set to the name of the table
+ */
+bool isRowPreserving( const QgsSql::Node&, QString& table );
+
 /**
  * Type used to define the type of a column
  *
@@ -758,4 +775,28 @@ public:
  */
 QList<ColumnType> columnTypes( const Node& n, QString& errMsg, const TableDefs* tableContext = 0 );
 
+/**
+ * Lineage of an output column: the column of a table it copies, if any
+ */
+struct ColumnLineage
+{
+    ColumnLineage( const QString& aName = "", const QString& aTable = "", const QString& aColumn = "" ) : name(aName), table(aTable), column(aColumn) {}
+
+    //! name of the output column
+    QString name;
+    //! table and column copied, empty if the output column is computed
+    QString table;
+    QString column;
+
+    bool isDirect() const { return !table.isEmpty(); }
+};
+
+/**
+ * Return the lineage of the output columns of a row preserving query (see isRowPreserving)
+ *
+ * Plain references to columns of the table are direct copies. Columns of a '*' are taken from tableContext.
+ * Returns an empty list for other queries, where no output column is an untransformed copy of a source column.
+ */
+QList<ColumnLineage> columnLineage( const Node& n, const TableDefs& tableContext );
+
 } // namespace QgsSql
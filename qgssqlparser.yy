@@ -213,7 +213,7 @@ select_core:    SELECT
                 optional_from
                 optional_where
                 optional_group_by
-                { $$ = new QgsSql::Select( $3, $4, static_cast<QgsSql::Expression*>($5), $2 ); }
+                { $$ = new QgsSql::Select( $3, $4, static_cast<QgsSql::Expression*>($5), $2, static_cast<QgsSql::GroupBy*>($6) ); }
         ;
 
 is_distinct_or_all:
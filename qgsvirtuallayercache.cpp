@@ -0,0 +1,146 @@
+/***************************************************************************
+                   qgsvirtuallayercache.cpp
+      Change stamps of sources and cache of values derived from them
+begin                : Oct 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdexcept>
+
+#include <QFileInfo>
+#include <QDateTime>
+#include <QUrl>
+#include <QUuid>
+
+#include <qgsdatasourceuri.h>
+
+#include "qgsvirtuallayercache.h"
+#include "sqlite_helper.h"
+
+// files read by a provider, empty if none
+// side files are listed whether they exist or not, since they may be created later
+static QStringList sourceFiles( const QString& provider, const QString& source )
+{
+    QString path;
+    if ( provider == "ogr" || provider == "gdal" ) {
+        // path|layerid=0
+        path = source.section( '|', 0, 0 );
+    }
+    else if ( provider == "spatialite" ) {
+        path = QgsDataSourceURI( source ).database();
+    }
+    else if ( provider == "delimitedtext" || provider == "gpx" ) {
+        // file:///path?options
+        path = QUrl( source ).toLocalFile();
+        if ( path.isEmpty() ) {
+            path = source.section( '?', 0, 0 );
+        }
+    }
+    if ( path.isEmpty() || !QFileInfo( path ).isFile() ) {
+        return QStringList();
+    }
+
+    QStringList files;
+    files << path;
+    QString suffix = QFileInfo( path ).suffix();
+    QString base = path.left( path.length() - suffix.length() );
+    bool upper = suffix == suffix.toUpper();
+    suffix = suffix.toLower();
+    if ( provider == "ogr" && suffix == "shp" ) {
+        // attributes and indexes of a shapefile
+        foreach( const QString& ext, QStringList() << "dbf" << "shx" << "qix" ) {
+            files << base + ( upper ? ext.toUpper() : ext );
+        }
+    }
+    else if ( provider == "spatialite" || ( provider == "ogr" && ( suffix == "sqlite" || suffix == "gpkg" || suffix == "db" ) ) ) {
+        // changes not checkpointed yet
+        files << path + "-wal";
+    }
+    return files;
+}
+
+QgsVirtualLayerSourceStamp::QgsVirtualLayerSourceStamp()
+    : mVolatile( false )
+    , mToken( QUuid::createUuid().toString() )
+    , mVersion( 0 )
+{
+}
+
+void QgsVirtualLayerSourceStamp::addSource( const QString& provider, const QString& source )
+{
+    QStringList files = sourceFiles( provider, source );
+    if ( files.isEmpty() ) {
+        mVolatile = true;
+    }
+    else {
+        mFiles << files;
+    }
+}
+
+void QgsVirtualLayerSourceStamp::addLayer( const QString& )
+{
+    mVolatile = true;
+}
+
+void QgsVirtualLayerSourceStamp::touch()
+{
+    mVersion.fetchAndAddOrdered( 1 );
+}
+
+QString QgsVirtualLayerSourceStamp::stamp() const
+{
+    QStringList parts;
+    foreach( const QString& path, mFiles ) {
+        QFileInfo fi( path );
+        if ( fi.exists() ) {
+            parts << QString( "%1:%2" ).arg( fi.lastModified().toMSecsSinceEpoch() ).arg( fi.size() );
+        }
+        else {
+            parts << "-";
+        }
+    }
+    if ( mVolatile ) {
+        parts << QString( "%1:%2" ).arg( mToken ).arg( int(mVersion) );
+    }
+    return parts.join( ";" );
+}
+
+namespace QgsVirtualLayerMetaCache
+{
+
+void init( sqlite3* db )
+{
+    Sqlite::Query::exec( db, "CREATE TABLE IF NOT EXISTS _meta_cache(key TEXT PRIMARY KEY, stamp TEXT, value TEXT)" );
+}
+
+bool get( sqlite3* db, const QString& key, const QString& stamp, QString& value )
+{
+    Sqlite::Query q( db, "SELECT value FROM _meta_cache WHERE key=? AND stamp=?" );
+    q.bind( key ).bind( stamp );
+    if ( q.step() != SQLITE_ROW ) {
+        return false;
+    }
+    value = q.column_text( 0 );
+    return true;
+}
+
+void put( sqlite3* db, const QString& key, const QString& stamp, const QString& value )
+{
+    Sqlite::Query q( db, "INSERT OR REPLACE INTO _meta_cache(key, stamp, value) VALUES (?, ?, ?)" );
+    q.bind( key ).bind( stamp ).bind( value );
+    if ( q.step() != SQLITE_DONE ) {
+        throw std::runtime_error( sqlite3_errmsg( db ) );
+    }
+}
+
+}
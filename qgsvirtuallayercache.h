@@ -0,0 +1,83 @@
+/***************************************************************************
+                   qgsvirtuallayercache.h
+      Change stamps of sources and cache of values derived from them
+begin                : Oct 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+#ifndef QGSVIRTUALLAYER_CACHE_H
+#define QGSVIRTUALLAYER_CACHE_H
+
+#include <QString>
+#include <QStringList>
+#include <QAtomicInt>
+
+struct sqlite3;
+
+/**
+ * Stamp of the state of the sources of a virtual layer
+ *
+ * File based sources are stamped with the modification time and size of their files,
+ * side files such as .dbf or -wal included, which stays meaningful across sessions. Changes of other sources cannot be detected: they are
+ * stamped with a token unique to this object and a version bumped by touch(), when
+ * the corresponding layer signals a change.
+ *
+ * Methods are thread safe once all the sources have been added.
+ */
+class QgsVirtualLayerSourceStamp
+{
+public:
+    QgsVirtualLayerSourceStamp();
+
+    //! Add an embedded source
+    void addSource( const QString& provider, const QString& source );
+
+    //! Add a live layer
+    void addLayer( const QString& id );
+
+    //! To be called when a live layer signals a change
+    void touch();
+
+    //! Current stamp, different each time sources change
+    QString stamp() const;
+
+    //! Whether stamps can be compared with ones from a previous session
+    bool isPersistent() const { return !mVolatile; }
+
+private:
+    // source files
+    QStringList mFiles;
+    // whether some sources have no file
+    bool mVolatile;
+    QString mToken;
+    QAtomicInt mVersion;
+};
+
+/**
+ * Values derived from the sources, stored in the _meta_cache table of the virtual layer database
+ *
+ * Each value is stored with the stamp of the sources it was computed from, and is only returned
+ * for the same stamp.
+ */
+namespace QgsVirtualLayerMetaCache
+{
+    //! Create the _meta_cache table if needed
+    void init( sqlite3* db );
+
+    //! Get a value, returns false if absent or computed from another state of the sources
+    bool get( sqlite3* db, const QString& key, const QString& stamp, QString& value );
+
+    //! Store a value
+    void put( sqlite3* db, const QString& key, const QString& stamp, const QString& value );
+}
+
+#endif
@@ -44,6 +44,8 @@ void QgsVirtualLayerDefinition::fromUrl( const QUrl& url )
 
     mGeometrySrid = -1;
     mGeometryWkbType = QGis::WKBNoGeometry;
+    mSpatialIndex = false;
+    mMaterialized = false;
 
     int layer_idx = 0;
     QList<QPair<QByteArray, QByteArray> > items = url.encodedQueryItems();
@@ -116,6 +118,22 @@ void QgsVirtualLayerDefinition::fromUrl( const QUrl& url )
         else if ( key == "uid" ) {
             mUid = value;
         }
+        else if ( key == "cache" ) {
+            // name of a source layer to cache in memory
+            mCachedLayers << value;
+        }
+        else if ( key == "prefetch" ) {
+            // name of a source layer to read ahead in a worker thread
+            mPrefetchedLayers << value;
+        }
+        else if ( key == "spatial_index" ) {
+            // index the output of the query
+            mSpatialIndex = true;
+        }
+        else if ( key == "materialize" ) {
+            // store the output of the query, unless materialize=0
+            mMaterialized = value != "0";
+        }
         else if ( key == "query" ) {
             // url encoded query
             mQuery = QUrl::fromPercentEncoding(value.toLocal8Bit());
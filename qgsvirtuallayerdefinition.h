@@ -17,6 +17,8 @@ email                : hugo dot mercier at oslandia dot com
 #ifndef QGSVIRTUALLAYERDEFINITION_H
 #define QGSVIRTUALLAYERDEFINITION_H
 
+#include <QStringList>
+
 #include <qgsfield.h>
 #include <qgis.h>
 
@@ -45,7 +47,7 @@ class QgsVirtualLayerDefinition
         QString mEncoding;
     };
 
-    QgsVirtualLayerDefinition( const QString& uri = "" ) : mUri(uri) {}
+    QgsVirtualLayerDefinition( const QString& uri = "" ) : mUri(uri), mSpatialIndex(false), mMaterialized(false) {}
     QgsVirtualLayerDefinition( const QUrl& );
 
     void fromUrl( const QUrl& );
@@ -86,6 +88,22 @@ class QgsVirtualLayerDefinition
     QgsFields overridenFields() const { return mOverridenFields; }
     void setOverridenFields( const QgsFields& fields ) { mOverridenFields = fields; }
 
+    //! Whether scans of a source table are served from an in-memory snapshot
+    bool isCached( const QString& name ) const { return mCachedLayers.contains( name ); }
+    void setCached( const QString& name ) { mCachedLayers << name; }
+
+    //! Whether features of a source table are read ahead in a worker thread
+    bool isPrefetched( const QString& name ) const { return mPrefetchedLayers.contains( name ); }
+    void setPrefetched( const QString& name ) { mPrefetchedLayers << name; }
+
+    //! Whether rectangle requests on the query output go through a spatial index
+    bool hasSpatialIndex() const { return mSpatialIndex; }
+    void setSpatialIndex( bool spatialIndex ) { mSpatialIndex = spatialIndex; }
+
+    //! Whether the output of the query is stored in a table, refreshed when the sources change
+    bool isMaterialized() const { return mMaterialized; }
+    void setMaterialized( bool materialized ) { mMaterialized = materialized; }
+
 private:
     QList<SourceLayer> mSourceLayers;
     QString mQuery;
@@ -93,6 +111,10 @@ private:
     QString mGeometryField;
     QString mUri;
     QgsFields mOverridenFields;
+    QStringList mCachedLayers;
+    QStringList mPrefetchedLayers;
+    bool mSpatialIndex;
+    bool mMaterialized;
     QGis::WkbType mGeometryWkbType;
     long mGeometrySrid;
 };
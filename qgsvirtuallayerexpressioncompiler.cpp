@@ -0,0 +1,350 @@
+/***************************************************************************
+                qgsvirtuallayerexpressioncompiler.cpp
+        Translation of QGIS expressions to SQLite / Spatialite SQL
+begin                : Oct 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "qgsvirtuallayerexpressioncompiler.h"
+
+static QString quotedIdentifier( QString name )
+{
+    return "\"" + name.replace("\"", "\"\"") + "\"";
+}
+
+QgsVirtualLayerExpressionCompiler::QgsVirtualLayerExpressionCompiler( const QgsFields& fields )
+    : mFields( fields )
+{
+}
+
+QgsVirtualLayerExpressionCompiler::Result QgsVirtualLayerExpressionCompiler::compile( const QgsExpression* exp )
+{
+    mResult.clear();
+    if ( !exp->rootNode() ) {
+        return Fail;
+    }
+    return compile( exp->rootNode(), mResult );
+}
+
+QString QgsVirtualLayerExpressionCompiler::quotedLiteral( const QVariant& value, bool& ok ) const
+{
+    ok = true;
+    if ( value.isNull() ) {
+        return "NULL";
+    }
+    switch ( value.type() ) {
+    case QVariant::Int:
+    case QVariant::LongLong:
+        return value.toString();
+    case QVariant::Double:
+        return QString::number( value.toDouble(), 'g', 17 );
+    case QVariant::Bool:
+        return value.toBool() ? "1" : "0";
+    case QVariant::String:
+        return "'" + value.toString().replace( "'", "''" ) + "'";
+    default:
+        ok = false;
+        return QString();
+    }
+}
+
+static bool isNumericType( QVariant::Type t )
+{
+    return t == QVariant::Int || t == QVariant::UInt || t == QVariant::LongLong || t == QVariant::ULongLong || t == QVariant::Double;
+}
+
+QgsVirtualLayerExpressionCompiler::ValueKind QgsVirtualLayerExpressionCompiler::valueKind( const QgsExpression::Node* node ) const
+{
+    switch ( node->nodeType() ) {
+    case QgsExpression::ntLiteral:
+    {
+        QVariant v = static_cast<const QgsExpression::NodeLiteral*>( node )->value();
+        if ( v.isNull() ) {
+            return NullValue;
+        }
+        if ( isNumericType( v.type() ) ) {
+            return NumericValue;
+        }
+        if ( v.type() == QVariant::String ) {
+            // QGIS compares numeric strings as numbers
+            bool ok;
+            v.toString().toDouble( &ok );
+            return ok ? UnknownValue : TextValue;
+        }
+        return UnknownValue;
+    }
+    case QgsExpression::ntColumnRef:
+    {
+        int idx = mFields.indexFromName( static_cast<const QgsExpression::NodeColumnRef*>( node )->name() );
+        if ( idx == -1 ) {
+            return UnknownValue;
+        }
+        QVariant::Type t = mFields.at( idx ).type();
+        if ( isNumericType( t ) ) {
+            return NumericValue;
+        }
+        return t == QVariant::String ? TextColumn : UnknownValue;
+    }
+    case QgsExpression::ntUnaryOperator:
+    {
+        const QgsExpression::NodeUnaryOperator* n = static_cast<const QgsExpression::NodeUnaryOperator*>( node );
+        if ( n->op() == QgsExpression::uoMinus && valueKind( n->operand() ) == NumericValue ) {
+            return NumericValue;
+        }
+        return UnknownValue;
+    }
+    case QgsExpression::ntBinaryOperator:
+    {
+        const QgsExpression::NodeBinaryOperator* n = static_cast<const QgsExpression::NodeBinaryOperator*>( node );
+        if ( ( n->op() == QgsExpression::boMinus || n->op() == QgsExpression::boMul || n->op() == QgsExpression::boDiv ) &&
+             valueKind( n->opLeft() ) == NumericValue && valueKind( n->opRight() ) == NumericValue ) {
+            return NumericValue;
+        }
+        return UnknownValue;
+    }
+    default:
+        return UnknownValue;
+    }
+}
+
+bool QgsVirtualLayerExpressionCompiler::isComparable( QgsExpression::BinaryOperator op, ValueKind left, ValueKind right ) const
+{
+    bool equality = op == QgsExpression::boEQ || op == QgsExpression::boNE || op == QgsExpression::boIs || op == QgsExpression::boIsNot;
+    if ( ( op == QgsExpression::boIs || op == QgsExpression::boIsNot ) && ( left == NullValue || right == NullValue ) ) {
+        return true;
+    }
+    if ( left == NumericValue && right == NumericValue ) {
+        return true;
+    }
+    // strings that are not numbers are compared byte by byte by both,
+    // but SQLite orders numbers stored in untyped columns before any string
+    if ( equality && ( left == TextValue || right == TextValue ) ) {
+        ValueKind other = left == TextValue ? right : left;
+        return other == TextValue || other == TextColumn;
+    }
+    return false;
+}
+
+QgsVirtualLayerExpressionCompiler::Result QgsVirtualLayerExpressionCompiler::compile( const QgsExpression::Node* node, QString& result )
+{
+    switch ( node->nodeType() ) {
+    case QgsExpression::ntUnaryOperator:
+    {
+        const QgsExpression::NodeUnaryOperator* n = static_cast<const QgsExpression::NodeUnaryOperator*>( node );
+        QString operand;
+        // NOT of a superset is not a superset
+        if ( compile( n->operand(), operand ) != Complete ) {
+            return Fail;
+        }
+        switch ( n->op() ) {
+        case QgsExpression::uoNot:
+            result = "NOT (" + operand + ")";
+            return Complete;
+        case QgsExpression::uoMinus:
+            result = "-(" + operand + ")";
+            return Complete;
+        }
+        return Fail;
+    }
+
+    case QgsExpression::ntBinaryOperator:
+    {
+        const QgsExpression::NodeBinaryOperator* n = static_cast<const QgsExpression::NodeBinaryOperator*>( node );
+        QString left, right;
+        Result rl = compile( n->opLeft(), left );
+        Result rr = compile( n->opRight(), right );
+
+        if ( n->op() == QgsExpression::boAnd ) {
+            // a failing term can be left to QGIS
+            if ( rl == Fail && rr == Fail ) {
+                return Fail;
+            }
+            if ( rl == Fail ) {
+                result = right;
+                return Partial;
+            }
+            if ( rr == Fail ) {
+                result = left;
+                return Partial;
+            }
+            result = "(" + left + ") AND (" + right + ")";
+            return rl == Complete && rr == Complete ? Complete : Partial;
+        }
+        if ( n->op() == QgsExpression::boOr ) {
+            // the union of supersets is a superset
+            if ( rl == Fail || rr == Fail ) {
+                return Fail;
+            }
+            result = "(" + left + ") OR (" + right + ")";
+            return rl == Complete && rr == Complete ? Complete : Partial;
+        }
+
+        if ( rl != Complete || rr != Complete ) {
+            return Fail;
+        }
+        QString op;
+        switch ( n->op() ) {
+        case QgsExpression::boEQ:
+        case QgsExpression::boNE:
+        case QgsExpression::boLE:
+        case QgsExpression::boGE:
+        case QgsExpression::boLT:
+        case QgsExpression::boGT:
+        case QgsExpression::boIs:
+        case QgsExpression::boIsNot:
+            // terms QGIS would compare differently are left to QGIS
+            if ( !isComparable( n->op(), valueKind( n->opLeft() ), valueKind( n->opRight() ) ) ) {
+                return Fail;
+            }
+            break;
+        default:
+            break;
+        }
+        switch ( n->op() ) {
+        case QgsExpression::boEQ:
+            op = "=";
+            break;
+        case QgsExpression::boNE:
+            op = "<>";
+            break;
+        case QgsExpression::boLE:
+            op = "<=";
+            break;
+        case QgsExpression::boGE:
+            op = ">=";
+            break;
+        case QgsExpression::boLT:
+            op = "<";
+            break;
+        case QgsExpression::boGT:
+            op = ">";
+            break;
+        case QgsExpression::boIs:
+            op = "IS";
+            break;
+        case QgsExpression::boIsNot:
+            op = "IS NOT";
+            break;
+        case QgsExpression::boILike:
+        case QgsExpression::boNotILike:
+        {
+            if ( valueKind( n->opLeft() ) != TextColumn ) {
+                return Fail;
+            }
+            // SQLite's LIKE only folds the case of ASCII letters, QGIS folds all of them:
+            // LIKE matches a subset of the rows, NOT LIKE a superset
+            if ( n->op() == QgsExpression::boNotILike ) {
+                result = "(" + left + ") NOT LIKE (" + right + ")";
+                return Partial;
+            }
+            if ( n->opRight()->nodeType() != QgsExpression::ntLiteral ) {
+                return Fail;
+            }
+            QString pattern = static_cast<const QgsExpression::NodeLiteral*>( n->opRight() )->value().toString();
+            for ( int i = 0; i < pattern.size(); i++ ) {
+                if ( pattern[i].unicode() >= 128 ) {
+                    return Fail;
+                }
+            }
+            // a pattern of ASCII characters matches the same rows, rechecked by QGIS
+            result = "(" + left + ") LIKE (" + right + ")";
+            return Partial;
+        }
+        case QgsExpression::boMinus:
+            op = "-";
+            break;
+        case QgsExpression::boMul:
+            op = "*";
+            break;
+        case QgsExpression::boDiv:
+            // QGIS always divides reals
+            result = "(CAST((" + left + ") AS REAL) / (" + right + "))";
+            return Complete;
+        case QgsExpression::boConcat:
+            op = "||";
+            break;
+        default:
+            // + also concatenates strings in QGIS, LIKE is case sensitive in QGIS,
+            // regexp, modulo and power have no SQLite equivalent
+            return Fail;
+        }
+        result = "(" + left + ") " + op + " (" + right + ")";
+        return Complete;
+    }
+
+    case QgsExpression::ntInOperator:
+    {
+        const QgsExpression::NodeInOperator* n = static_cast<const QgsExpression::NodeInOperator*>( node );
+        QString value;
+        if ( compile( n->node(), value ) != Complete ) {
+            return Fail;
+        }
+        QStringList list;
+        ValueKind kind = valueKind( n->node() );
+        foreach ( const QgsExpression::Node* ln, n->list()->list() ) {
+            QString s;
+            if ( compile( ln, s ) != Complete || !isComparable( QgsExpression::boEQ, kind, valueKind( ln ) ) ) {
+                return Fail;
+            }
+            list << s;
+        }
+        result = QString( "(%1) %2 (%3)" ).arg( value ).arg( n->isNotIn() ? "NOT IN" : "IN" ).arg( list.join( "," ) );
+        return Complete;
+    }
+
+    case QgsExpression::ntFunction:
+    {
+        const QgsExpression::NodeFunction* n = static_cast<const QgsExpression::NodeFunction*>( node );
+        QString name = QgsExpression::Functions()[n->fnIndex()]->name().toLower();
+        // functions with the same semantics in SQLite
+        // (lower and upper only change the case of ASCII letters in SQLite)
+        if ( name != "abs" && name != "coalesce" ) {
+            return Fail;
+        }
+        QStringList args;
+        if ( n->args() ) {
+            foreach ( const QgsExpression::Node* an, n->args()->list() ) {
+                QString s;
+                if ( compile( an, s ) != Complete ) {
+                    return Fail;
+                }
+                args << s;
+            }
+        }
+        result = name + "(" + args.join( "," ) + ")";
+        return Complete;
+    }
+
+    case QgsExpression::ntLiteral:
+    {
+        const QgsExpression::NodeLiteral* n = static_cast<const QgsExpression::NodeLiteral*>( node );
+        bool ok;
+        result = quotedLiteral( n->value(), ok );
+        return ok ? Complete : Fail;
+    }
+
+    case QgsExpression::ntColumnRef:
+    {
+        const QgsExpression::NodeColumnRef* n = static_cast<const QgsExpression::NodeColumnRef*>( node );
+        if ( mFields.indexFromName( n->name() ) == -1 ) {
+            // not a column of the virtual layer
+            return Fail;
+        }
+        result = quotedIdentifier( n->name() );
+        return Complete;
+    }
+
+    default:
+        return Fail;
+    }
+}
@@ -0,0 +1,71 @@
+/***************************************************************************
+                qgsvirtuallayerexpressioncompiler.h
+        Translation of QGIS expressions to SQLite / Spatialite SQL
+begin                : Oct 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+#ifndef QGSVIRTUALLAYER_EXPRESSION_COMPILER_H
+#define QGSVIRTUALLAYER_EXPRESSION_COMPILER_H
+
+#include <qgsexpression.h>
+#include <qgsfield.h>
+
+/**
+ * Compiles a QgsExpression into an SQL WHERE clause for the virtual layer query
+ *
+ * Only the subset of expressions with the same semantics in QGIS and SQLite is translated.
+ * When only some terms of an AND can be translated, the result is Partial: the SQL clause
+ * selects a superset of the features and the expression must still be evaluated by QGIS.
+ */
+class QgsVirtualLayerExpressionCompiler
+{
+  public:
+    enum Result
+    {
+      None,     //!< no expression compiled yet
+      Complete, //!< the SQL clause is equivalent to the expression
+      Partial,  //!< the SQL clause selects a superset of the features
+      Fail      //!< the expression cannot be translated
+    };
+
+    explicit QgsVirtualLayerExpressionCompiler( const QgsFields& fields );
+
+    Result compile( const QgsExpression* exp );
+
+    //! The SQL clause, valid if compile() returned Complete or Partial
+    QString result() const { return mResult; }
+
+  private:
+    Result compile( const QgsExpression::Node* node, QString& str );
+
+    QString quotedLiteral( const QVariant& value, bool& ok ) const;
+
+    // values compared the same way by QGIS and SQLite
+    enum ValueKind
+    {
+      UnknownValue, //!< may be compared as a number or as a string by QGIS
+      NumericValue, //!< number
+      TextValue,    //!< string literal that QGIS cannot convert to a number
+      TextColumn,   //!< column of strings
+      NullValue     //!< NULL literal
+    };
+    ValueKind valueKind( const QgsExpression::Node* node ) const;
+
+    // whether QGIS and SQLite give the same result for a comparison
+    bool isComparable( QgsExpression::BinaryOperator op, ValueKind left, ValueKind right ) const;
+
+    QgsFields mFields;
+    QString mResult;
+};
+
+#endif
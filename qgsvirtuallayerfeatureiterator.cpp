@@ -15,8 +15,14 @@ email                : hugo dot mercier at oslandia dot com
  *                                                                         *
  ***************************************************************************/
 
+#include <QSettings>
+#include <QDate>
+#include <QDateTime>
+#include <QTime>
+
 #include <qgsvirtuallayerfeatureiterator.h>
 #include <qgsmessagelog.h>
+#include "qgsvirtuallayerexpressioncompiler.h"
 #include "vlayer_module.h"
 
 static QString quotedColumn( QString name )
@@ -24,48 +30,190 @@ static QString quotedColumn( QString name )
     return "\"" + name.replace("\"", "\"\"") + "\"";
 }
 
+// readers of result columns, one per field type
+// NULL values give a null variant of the field type
+
+static QVariant readInt( sqlite3_stmt* stmt, int column )
+{
+    if ( sqlite3_column_type( stmt, column ) == SQLITE_NULL ) {
+        return QVariant( QVariant::Int );
+    }
+    return QVariant( sqlite3_column_int( stmt, column ) );
+}
+
+static QVariant readLongLong( sqlite3_stmt* stmt, int column )
+{
+    if ( sqlite3_column_type( stmt, column ) == SQLITE_NULL ) {
+        return QVariant( QVariant::LongLong );
+    }
+    return QVariant( (qlonglong)sqlite3_column_int64( stmt, column ) );
+}
+
+static QVariant readDouble( sqlite3_stmt* stmt, int column )
+{
+    if ( sqlite3_column_type( stmt, column ) == SQLITE_NULL ) {
+        return QVariant( QVariant::Double );
+    }
+    return QVariant( sqlite3_column_double( stmt, column ) );
+}
+
+static QVariant readBool( sqlite3_stmt* stmt, int column )
+{
+    if ( sqlite3_column_type( stmt, column ) == SQLITE_NULL ) {
+        return QVariant( QVariant::Bool );
+    }
+    return QVariant( sqlite3_column_int64( stmt, column ) != 0 );
+}
+
+// decode the text in place, without going through a QByteArray
+static QString columnString( sqlite3_stmt* stmt, int column )
+{
+    const char* str = (const char*)sqlite3_column_text( stmt, column );
+    return QString::fromUtf8( str, sqlite3_column_bytes( stmt, column ) );
+}
+
+static QVariant readString( sqlite3_stmt* stmt, int column )
+{
+    if ( sqlite3_column_type( stmt, column ) == SQLITE_NULL ) {
+        return QVariant( QVariant::String );
+    }
+    return QVariant( columnString( stmt, column ) );
+}
+
+static QVariant readDate( sqlite3_stmt* stmt, int column )
+{
+    if ( sqlite3_column_type( stmt, column ) == SQLITE_NULL ) {
+        return QVariant( QVariant::Date );
+    }
+    return QVariant( QDate::fromString( columnString( stmt, column ), Qt::ISODate ) );
+}
+
+static QVariant readDateTime( sqlite3_stmt* stmt, int column )
+{
+    if ( sqlite3_column_type( stmt, column ) == SQLITE_NULL ) {
+        return QVariant( QVariant::DateTime );
+    }
+    return QVariant( QDateTime::fromString( columnString( stmt, column ), Qt::ISODate ) );
+}
+
+static QVariant readTime( sqlite3_stmt* stmt, int column )
+{
+    if ( sqlite3_column_type( stmt, column ) == SQLITE_NULL ) {
+        return QVariant( QVariant::Time );
+    }
+    return QVariant( QTime::fromString( columnString( stmt, column ), Qt::ISODate ) );
+}
+
+// other types: let SQLite's own type decide
+static QVariant readAny( sqlite3_stmt* stmt, int column )
+{
+    switch ( sqlite3_column_type( stmt, column ) ) {
+    case SQLITE_INTEGER:
+        return QVariant( (qlonglong)sqlite3_column_int64( stmt, column ) );
+    case SQLITE_FLOAT:
+        return QVariant( sqlite3_column_double( stmt, column ) );
+    case SQLITE_TEXT:
+        return QVariant( columnString( stmt, column ) );
+    case SQLITE_BLOB:
+        return QVariant( QByteArray( (const char*)sqlite3_column_blob( stmt, column ), sqlite3_column_bytes( stmt, column ) ) );
+    default:
+        return QVariant();
+    }
+}
+
+QgsVirtualLayerFeatureIterator::ColumnReader QgsVirtualLayerFeatureIterator::columnReader( QVariant::Type type )
+{
+    switch ( type ) {
+    case QVariant::Int:
+        return readInt;
+    case QVariant::LongLong:
+        return readLongLong;
+    case QVariant::Double:
+        return readDouble;
+    case QVariant::String:
+        return readString;
+    case QVariant::Bool:
+        return readBool;
+    case QVariant::Date:
+        return readDate;
+    case QVariant::DateTime:
+        return readDateTime;
+    case QVariant::Time:
+        return readTime;
+    default:
+        return readAny;
+    }
+}
+
 QgsVirtualLayerFeatureIterator::QgsVirtualLayerFeatureIterator( QgsVirtualLayerFeatureSource* source, bool ownSource, const QgsFeatureRequest& request )
     : QgsAbstractFeatureIteratorFromSource<QgsVirtualLayerFeatureSource>( source, ownSource, request )
+    , mFidTableFilled( false )
+    , mExpressionCompiled( false )
+    , mHasGeometryColumn( false )
 {
     try {
         mPath = mSource->provider()->mPath;
-        mSqlite = Sqlite::open( mPath );
+        // a warm connection, with virtual tables already connected
+        mConnection = mSource->pool()->acquire();
         mDefinition = mSource->provider()->mDefinition;
 
         QString tableName = mSource->provider()->mTableName;
 
+        // bring the stored query output up to date
+        QSharedPointer<QgsVirtualLayerMaterialization> materialization = mSource->materialization();
+        if ( materialization ) {
+            materialization->refresh();
+        }
+
         QStringList wheres;
         QString subset = mSource->provider()->mSubset;
         if ( !subset.isNull() ) {
             wheres << subset;
         }
 
+        // rectangles and ids are bound as parameters, so that statements can be reused
+        bool bindRect = false;
+        bool bindFid = false;
         if ( !mDefinition.geometryField().isNull() && mDefinition.geometryField() != "*no*" && request.filterType() == QgsFeatureRequest::FilterRect ) {
             bool do_exact = request.flags() & QgsFeatureRequest::ExactIntersect;
-            QgsRectangle rect( request.filterRect() );
-            QString mbr = QString("%1,%2,%3,%4").arg(rect.xMinimum()).arg(rect.yMinimum()).arg(rect.xMaximum()).arg(rect.yMaximum());
-            wheres <<  QString("%1Intersects(%2,BuildMbr(%3))")
-                .arg(do_exact ? "Mbr" : "")
-                .arg(quotedColumn(mDefinition.geometryField()))
-                .arg(mbr);
+            QSharedPointer<QgsVirtualLayerViewIndex> index = mSource->viewIndex();
+            if ( materialization ) {
+                wheres << materialization->candidates();
+                if ( do_exact ) {
+                    wheres << QString("Intersects(%1,BuildMbr(?1,?2,?3,?4))").arg(quotedColumn(mDefinition.geometryField()));
+                }
+            }
+            else if ( index && index->isUsable() ) {
+                // candidates from the index, the exact test is only run on them
+                wheres << index->candidates();
+                if ( do_exact ) {
+                    wheres << QString("Intersects(%1,BuildMbr(?1,?2,?3,?4))").arg(quotedColumn(mDefinition.geometryField()));
+                }
+            }
+            else {
+                wheres << QString("%1Intersects(%2,BuildMbr(?1,?2,?3,?4))")
+                    .arg(do_exact ? "" : "Mbr")
+                    .arg(quotedColumn(mDefinition.geometryField()));
+            }
+            bindRect = true;
         }
         else if (!mDefinition.uid().isNull() && request.filterType() == QgsFeatureRequest::FilterFid ) {
-            wheres << QString("%1=%2")
-                .arg(quotedColumn(mDefinition.uid()))
-                .arg(request.filterFid());
+            wheres << QString("%1=?").arg(quotedColumn(mDefinition.uid()));
+            bindFid = true;
         }
         else if (!mDefinition.uid().isNull() && request.filterType() == QgsFeatureRequest::FilterFids ) {
-            QString values = quotedColumn(mDefinition.uid()) + " IN (";
-            bool first = true;
-            foreach ( auto& v, request.filterFids() ) {
-                if (!first) {
-                    values += ",";
-                }
-                first = false;
-                values += QString::number(v);
+            // ids are inserted in a temporary table, rather than in the query string
+            fillFidTable( request.filterFids() );
+            wheres << QString("%1 IN (SELECT id FROM temp._fids)").arg(quotedColumn(mDefinition.uid()));
+        }
+        else if ( request.filterType() == QgsFeatureRequest::FilterExpression && QSettings().value( "/qgis/compileExpressions", true ).toBool() ) {
+            // let SQLite evaluate what it can of the expression
+            QgsVirtualLayerExpressionCompiler compiler( mSource->provider()->fields() );
+            QgsVirtualLayerExpressionCompiler::Result result = compiler.compile( request.filterExpression() );
+            if ( result == QgsVirtualLayerExpressionCompiler::Complete || result == QgsVirtualLayerExpressionCompiler::Partial ) {
+                wheres << "(" + compiler.result() + ")";
+                mExpressionCompiled = result == QgsVirtualLayerExpressionCompiler::Complete;
             }
-            values += ")";
-            wheres << values;
         }
 
         mFields = mSource->provider()->fields();
@@ -80,6 +228,17 @@ QgsVirtualLayerFeatureIterator::QgsVirtualLayerFeatureIterator( QgsVirtualLayerF
             mAttributes = mFields.allAttributesList();
         }
 
+        // conversion plan, so that rows are read without any type dispatch
+        mReaders.reserve( mAttributes.size() );
+        foreach( int idx, mAttributes ) {
+            mReaders << columnReader( mFields.at(idx).type() );
+        }
+        for ( int idx = 0; idx < mFields.count(); idx++ ) {
+            if ( !mAttributes.contains( idx ) ) {
+                mUnrequestedAttributes << idx;
+            }
+        }
+
         QString columns;
         {
             // the first column is always the uid (or 0)
@@ -98,6 +257,7 @@ QgsVirtualLayerFeatureIterator::QgsVirtualLayerFeatureIterator( QgsVirtualLayerF
         // the last column is the geometry, if any
         if ( !(request.flags() & QgsFeatureRequest::NoGeometry) && !mDefinition.geometryField().isNull() && mDefinition.geometryField() != "*no*" ) {
             columns += "," + quotedColumn(mDefinition.geometryField());
+            mHasGeometryColumn = true;
         }
 
         mSqlQuery = "SELECT " + columns + " FROM " + tableName;
@@ -105,7 +265,14 @@ QgsVirtualLayerFeatureIterator::QgsVirtualLayerFeatureIterator( QgsVirtualLayerF
             mSqlQuery += " WHERE " + wheres.join(" AND ");
         }
 
-        mQuery.reset( new Sqlite::Query( mSqlite.get(), mSqlQuery ) );
+        mQuery.reset( mConnection->take( mSqlQuery ) );
+        if ( bindRect ) {
+            QgsRectangle rect( request.filterRect() );
+            mQuery->bind( rect.xMinimum(), 1 ).bind( rect.yMinimum(), 2 ).bind( rect.xMaximum(), 3 ).bind( rect.yMaximum(), 4 );
+        }
+        else if ( bindFid ) {
+            mQuery->bind( (qint64)request.filterFid(), 1 );
+        }
 
         mFid = 0;
     }
@@ -138,6 +305,21 @@ bool QgsVirtualLayerFeatureIterator::close()
         return false;
     }
 
+    // give the statement and the connection back
+    if ( mQuery ) {
+        mConnection->giveBack( mSqlQuery, mQuery.take() );
+    }
+    if ( mFidTableFilled ) {
+        try {
+            Sqlite::Query::exec( mConnection->get(), "DELETE FROM temp._fids" );
+        }
+        catch (std::runtime_error& e) {
+            QgsMessageLog::logMessage( e.what(), QObject::tr( "VLayer" ) );
+        }
+        mFidTableFilled = false;
+    }
+    mSource->pool()->release( std::move( mConnection ) );
+
     // this call is absolutely needed
     iteratorClosed();
 
@@ -145,20 +327,74 @@ bool QgsVirtualLayerFeatureIterator::close()
     return true;
 }
 
+#if VERSION_INT >= 21000
+bool QgsVirtualLayerFeatureIterator::nextFeatureFilterExpression( QgsFeature& f )
+{
+    if ( mExpressionCompiled ) {
+        // already filtered by SQLite
+        return fetchFeature( f );
+    }
+    return QgsAbstractFeatureIterator::nextFeatureFilterExpression( f );
+}
+#endif
+
+void QgsVirtualLayerFeatureIterator::fillFidTable( const QgsFeatureIds& fids )
+{
+    // the temporary table is private to the connection, which is not shared while the iterator is alive
+    Sqlite::Query::exec( mConnection->get(), "PRAGMA temp_store=MEMORY;"
+                         "CREATE TEMP TABLE IF NOT EXISTS _fids(id INTEGER PRIMARY KEY);"
+                         "DELETE FROM temp._fids;"
+                         "BEGIN" );
+    mFidTableFilled = true;
+    const QString insertSql( "INSERT OR IGNORE INTO temp._fids VALUES(?)" );
+    Sqlite::Query* insert = mConnection->take( insertSql );
+    try {
+        foreach ( QgsFeatureId id, fids ) {
+            insert->bind( (qint64)id, 1 );
+            if ( insert->step() != SQLITE_DONE ) {
+                throw std::runtime_error( sqlite3_errmsg( mConnection->get() ) );
+            }
+            sqlite3_reset( insert->stmt() );
+        }
+    }
+    catch (std::runtime_error&) {
+        mConnection->giveBack( insertSql, insert );
+        Sqlite::Query::exec( mConnection->get(), "ROLLBACK" );
+        throw;
+    }
+    mConnection->giveBack( insertSql, insert );
+    Sqlite::Query::exec( mConnection->get(), "COMMIT" );
+}
+
 bool QgsVirtualLayerFeatureIterator::fetchFeature( QgsFeature& feature )
 {
     if (mClosed) {
         return false;
     }
-    if (mQuery->step() != SQLITE_ROW) {
+    int r = mQuery->step();
+    if ( r != SQLITE_ROW ) {
+        if ( r != SQLITE_DONE ) {
+            // iterators cannot report errors, which must at least not pass for the end of the features
+            QgsMessageLog::logMessage( QString( "Cannot read features: %1" ).arg( sqlite3_errmsg( mConnection->get() ) ), QObject::tr( "VLayer" ), QgsMessageLog::CRITICAL );
+            close();
+        }
         return false;
     }
 
+    // the attribute storage of the feature is reused across rows
 #if VERSION_INT <= 20900
-    feature.setFields( &mFields, /* init */ true );
+    feature.setFields( &mFields, /* init */ false );
 #else
-    feature.setFields( mFields, /* init */ true );
+    feature.setFields( mFields, /* init */ false );
 #endif
+    if ( feature.attributes().size() != mFields.count() ) {
+        feature.initAttributes( mFields.count() );
+    }
+    else {
+        foreach( int idx, mUnrequestedAttributes ) {
+            feature.setAttribute( idx, QVariant() );
+        }
+    }
 
     if ( mDefinition.uid().isNull() ) {
         // no id column => autoincrement
@@ -169,38 +405,31 @@ bool QgsVirtualLayerFeatureIterator::fetchFeature( QgsFeature& feature )
         feature.setFeatureId( mQuery->column_int64( 0 ) );
     }
 
-    int n = mQuery->column_count();
-    int i = 0;
-    foreach( int idx, mAttributes ) {
-        const QgsField& f = mFields.at(idx);
-        if ( f.type() == QVariant::Int ) {
-            feature.setAttribute( idx, mQuery->column_int(i+1) );
-        }
-        else if ( f.type() == QVariant::LongLong ) {
-            feature.setAttribute( idx, mQuery->column_int64(i+1) );
-        }
-        else if ( f.type() == QVariant::Double ) {
-            feature.setAttribute( idx, mQuery->column_double(i+1) );
-        }
-        else if ( f.type() == QVariant::String ) {
-            feature.setAttribute( idx, mQuery->column_text(i+1) );
-        }
-        i++;
+    sqlite3_stmt* stmt = mQuery->stmt();
+    const int nAttributes = mAttributes.size();
+    for ( int i = 0; i < nAttributes; i++ ) {
+        feature.setAttribute( mAttributes[i], mReaders[i]( stmt, i+1 ) );
     }
-    if (n > mAttributes.size()+1) {
-        // geometry field
-        QByteArray blob( mQuery->column_blob(n-1) );
-        if ( blob.size() > 0 ) {
-            std::unique_ptr<QgsGeometry> geom( spatialite_blob_to_qgsgeometry( (const unsigned char*)blob.constData(), blob.size() ) );
+
+    if ( mHasGeometryColumn ) {
+        // geometry field, decoded straight from the column buffer
+        const int n = nAttributes + 1;
+        const unsigned char* blob = (const unsigned char*)sqlite3_column_blob( stmt, n );
+        int blob_size = sqlite3_column_bytes( stmt, n );
+        if ( blob_size > 0 ) {
+            std::unique_ptr<QgsGeometry> geom( spatialite_blob_to_qgsgeometry( blob, blob_size ) );
             feature.setGeometry( geom.release() );
         }
+        else {
+            feature.setGeometry( (QgsGeometry*)0 );
+        }
     }
 
     return true;
 }
 
 QgsVirtualLayerFeatureSource::QgsVirtualLayerFeatureSource( const QgsVirtualLayerProvider* p ) :
-    mProvider(p)
+    mProvider(p), mPool(p->mPool), mViewIndex(p->mViewIndex), mMaterialization(p->mMaterialization)
 {
 }
 
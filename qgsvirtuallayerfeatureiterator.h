@@ -19,8 +19,12 @@ email                : hugo dot mercier at oslandia dot com
 
 
 #include <qgsvirtuallayerprovider.h>
+#include "qgsvirtuallayerviewindex.h"
+#include "qgsvirtuallayermaterialization.h"
 #include <qgsfeatureiterator.h>
 
+#include <QVector>
+
 class QgsVirtualLayerFeatureSource : public QgsAbstractFeatureSource
 {
 public:
@@ -30,8 +34,20 @@ public:
     virtual QgsFeatureIterator getFeatures( const QgsFeatureRequest& request ) override;
 
     const QgsVirtualLayerProvider* provider() const { return mProvider; }
+
+    //! Read connections to the virtual layer database
+    QSharedPointer<Sqlite::ConnectionPool> pool() const { return mPool; }
+
+    //! Spatial index of the query output, null if disabled
+    QSharedPointer<QgsVirtualLayerViewIndex> viewIndex() const { return mViewIndex; }
+
+    //! Table storing the query output, null if disabled
+    QSharedPointer<QgsVirtualLayerMaterialization> materialization() const { return mMaterialization; }
 private:
     const QgsVirtualLayerProvider* mProvider;
+    QSharedPointer<Sqlite::ConnectionPool> mPool;
+    QSharedPointer<QgsVirtualLayerViewIndex> mViewIndex;
+    QSharedPointer<QgsVirtualLayerMaterialization> mMaterialization;
 };
 
 class QgsVirtualLayerFeatureIterator : public QgsAbstractFeatureIteratorFromSource<QgsVirtualLayerFeatureSource>
@@ -46,17 +62,33 @@ class QgsVirtualLayerFeatureIterator : public QgsAbstractFeatureIteratorFromSour
     //! end of iterating: free the resources / lock
     virtual bool close() override;
 
+    //! conversion of a result column to the type of its field
+    typedef QVariant (*ColumnReader)( sqlite3_stmt* stmt, int column );
+    static ColumnReader columnReader( QVariant::Type type );
+
   protected:
 
     //! fetch next feature, return true on success
     virtual bool fetchFeature( QgsFeature& feature ) override;
 
+#if VERSION_INT >= 21000
+    //! skip the evaluation of filter expressions entirely compiled to SQL
+    virtual bool nextFeatureFilterExpression( QgsFeature& f ) override;
+#endif
+
     QScopedPointer<Sqlite::Query> mQuery;
 
     QgsFeatureId mFid;
 
     QString mPath;
-    QgsScopedSqlite mSqlite;
+    std::unique_ptr<Sqlite::Connection> mConnection;
+
+    // whether temp._fids holds the ids of a FilterFids request
+    bool mFidTableFilled;
+    void fillFidTable( const QgsFeatureIds& fids );
+
+    // whether the filter expression is entirely evaluated by SQLite
+    bool mExpressionCompiled;
     QgsVirtualLayerDefinition mDefinition;
     QgsFields mFields;
 
@@ -66,6 +98,15 @@ class QgsVirtualLayerFeatureIterator : public QgsAbstractFeatureIteratorFromSour
     int mUidColumn;
 
     QgsAttributeList mAttributes;
+
+    // readers of each output column, parallel to mAttributes
+    QVector<ColumnReader> mReaders;
+
+    // attributes not fetched, to be reset on reused features
+    QgsAttributeList mUnrequestedAttributes;
+
+    // whether the last column of the query is the geometry
+    bool mHasGeometryColumn;
 };
 
 #endif
@@ -0,0 +1,113 @@
+/***************************************************************************
+                   qgsvirtuallayermaterialization.cpp
+          Storage of the output of a virtual layer query in a table
+begin                : Oct 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdexcept>
+
+#include <qgsmessagelog.h>
+
+#include "qgsvirtuallayermaterialization.h"
+#include "sqlite_helper.h"
+
+const char* QgsVirtualLayerMaterialization::TABLE = "_materialized";
+const char* QgsVirtualLayerMaterialization::INDEX_TABLE = "_materialized_rtree";
+
+// key of the table stamp in the meta cache
+static const char* STAMP_KEY = "materialized";
+
+// how long a refresh waits for readers of the table to finish (ms)
+static const int BUSY_TIMEOUT = 10000;
+
+static QString quotedColumn( QString name )
+{
+    return "\"" + name.replace("\"", "\"\"") + "\"";
+}
+
+QgsVirtualLayerMaterialization::QgsVirtualLayerMaterialization( const QString& path, const QString& uid, const QString& geometryField, QSharedPointer<QgsVirtualLayerSourceStamp> stamp )
+    : mPath( path )
+    , mUid( uid )
+    , mGeometryField( geometryField )
+    , mStamp( stamp )
+{
+    // the table saved by a previous session may still be up to date
+    if ( mStamp->isPersistent() ) {
+        try {
+            QgsScopedSqlite db( Sqlite::open( mPath ) );
+            QString value;
+            if ( QgsVirtualLayerMetaCache::get( db.get(), STAMP_KEY, mStamp->stamp(), value ) ) {
+                mTableStamp = mStamp->stamp();
+            }
+        }
+        catch ( std::runtime_error& e ) {
+            QgsMessageLog::logMessage( e.what(), QObject::tr( "VLayer" ) );
+        }
+    }
+}
+
+void QgsVirtualLayerMaterialization::create( sqlite3* db, const QString& uid, const QString& geometryField )
+{
+    // columns are those of the view, rows are inserted on the first refresh
+    QString sql = QString( "DROP TABLE IF EXISTS %1; CREATE TABLE %1 AS SELECT * FROM _view LIMIT 0;" ).arg( TABLE );
+    if ( !uid.isEmpty() ) {
+        sql += QString( "CREATE INDEX %1_uid ON %1(%2);" ).arg( TABLE ).arg( quotedColumn( uid ) );
+    }
+    if ( !geometryField.isEmpty() ) {
+        sql += QString( "DROP TABLE IF EXISTS %1; CREATE VIRTUAL TABLE %1 USING rtree(id, minx, maxx, miny, maxy);" ).arg( INDEX_TABLE );
+    }
+    Sqlite::Query::exec( db, sql );
+}
+
+bool QgsVirtualLayerMaterialization::refresh()
+{
+    QString stamp = mStamp->stamp();
+    QMutexLocker lock( &mMutex );
+    if ( mTableStamp == stamp ) {
+        return true;
+    }
+
+    try {
+        QgsScopedSqlite db( Sqlite::open( mPath ) );
+        sqlite3_busy_timeout( db.get(), BUSY_TIMEOUT );
+        try {
+            Sqlite::Query::exec( db.get(), "BEGIN" );
+            Sqlite::Query::exec( db.get(), QString( "DELETE FROM %1; INSERT INTO %1 SELECT * FROM _view" ).arg( TABLE ) );
+            if ( !mGeometryField.isEmpty() ) {
+                Sqlite::Query::exec( db.get(), QString( "DELETE FROM %1; INSERT INTO %1 SELECT rowid, MbrMinX(%3), MbrMaxX(%3), MbrMinY(%3), MbrMaxY(%3) FROM %2 WHERE %3 IS NOT NULL" )
+                                     .arg( INDEX_TABLE )
+                                     .arg( TABLE )
+                                     .arg( quotedColumn( mGeometryField ) ) );
+            }
+            QgsVirtualLayerMetaCache::put( db.get(), STAMP_KEY, stamp, QString() );
+            Sqlite::Query::exec( db.get(), "COMMIT" );
+        }
+        catch ( std::runtime_error& ) {
+            sqlite3_exec( db.get(), "ROLLBACK", NULL, NULL, NULL );
+            throw;
+        }
+    }
+    catch ( std::runtime_error& e ) {
+        // the previous content is kept
+        QgsMessageLog::logMessage( QString( "Cannot refresh the materialized layer: %1" ).arg( e.what() ), QObject::tr( "VLayer" ) );
+        return false;
+    }
+    mTableStamp = stamp;
+    return true;
+}
+
+QString QgsVirtualLayerMaterialization::candidates() const
+{
+    return QString( "rowid IN (SELECT id FROM %1 WHERE minx <= ?3 AND maxx >= ?1 AND miny <= ?4 AND maxy >= ?2)" ).arg( INDEX_TABLE );
+}
@@ -0,0 +1,64 @@
+/***************************************************************************
+                   qgsvirtuallayermaterialization.h
+          Storage of the output of a virtual layer query in a table
+begin                : Oct 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+#ifndef QGSVIRTUALLAYER_MATERIALIZATION_H
+#define QGSVIRTUALLAYER_MATERIALIZATION_H
+
+#include <QMutex>
+#include <QSharedPointer>
+
+#include "qgsvirtuallayercache.h"
+
+struct sqlite3;
+
+/**
+ * Result of _view stored in the _materialized table, with an R*Tree on its rowids
+ *
+ * The table is refreshed when it is read after a change of the sources. The refresh
+ * is complete: sources only tell that they changed, not which of their rows did.
+ */
+class QgsVirtualLayerMaterialization
+{
+public:
+    //! name of the table
+    static const char* TABLE;
+    //! name of the spatial index
+    static const char* INDEX_TABLE;
+
+    QgsVirtualLayerMaterialization( const QString& path, const QString& uid, const QString& geometryField, QSharedPointer<QgsVirtualLayerSourceStamp> stamp );
+
+    //! Create the (empty) table and its indexes
+    static void create( sqlite3* db, const QString& uid, const QString& geometryField );
+
+    //! Refresh the table if the sources changed, returns false if it could not be refreshed
+    bool refresh();
+
+    //! Predicate selecting the rows intersecting the ?1,?2,?3,?4 rectangle
+    QString candidates() const;
+
+private:
+    QString mPath;
+    QString mUid;
+    QString mGeometryField;
+    QSharedPointer<QgsVirtualLayerSourceStamp> mStamp;
+
+    // serializes refreshes
+    QMutex mMutex;
+    // stamp of the sources the table has been filled from
+    QString mTableStamp;
+};
+
+#endif
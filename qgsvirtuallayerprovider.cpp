@@ -20,20 +20,66 @@ extern "C" {
 }
 
 #include <QUrl>
+#include <QtConcurrentMap>
 
 #include <qgsvirtuallayerprovider.h>
 #include <qgsvirtuallayerdefinition.h>
 #include <qgsvirtuallayerfeatureiterator.h>
+#include "qgsvirtuallayercache.h"
+#include "qgsvirtuallayerviewindex.h"
+#include "qgsvirtuallayermaterialization.h"
+#include "qgsvirtuallayerstatistics.h"
 #include <qgssql.h>
 #include <qgsvectorlayer.h>
 #include <qgsmaplayerregistry.h>
 #include <qgsdatasourceuri.h>
+#include <qgsmessagelog.h>
 #include "sqlite_helper.h"
 #include "vlayer_module.h"
+#include "vlayer_cache.h"
 
 const QString VIRTUAL_LAYER_KEY = "virtual";
 const QString VIRTUAL_LAYER_DESCRIPTION = "Virtual layer data provider";
 
+// provider, source and encoding of an embedded layer
+struct EmbeddedSource
+{
+    QString provider;
+    QString source;
+    QString encoding;
+};
+
+// opens the provider of an embedded layer and reads what its virtual table needs, on a thread of the pool
+struct OpenEmbeddedSource
+{
+    typedef QgsVectorDataProvider* result_type;
+
+    QgsVectorDataProvider* operator()( const EmbeddedSource& s ) const
+    {
+        QgsVectorDataProvider* p = VLayerProviderRegistry::instance()->acquire( s.provider, s.source, s.encoding );
+        if ( p ) {
+            p->fields();
+            long count;
+            QgsRectangle extent;
+            VLayerProviderRegistry::instance()->statistics( p, count, extent );
+        }
+        return p;
+    }
+};
+
+// providers kept open while virtual tables are created
+struct AcquiredProviders : public QList<QgsVectorDataProvider*>
+{
+    ~AcquiredProviders()
+    {
+        foreach ( QgsVectorDataProvider* p, *this ) {
+            if ( p ) {
+                VLayerProviderRegistry::instance()->release( p );
+            }
+        }
+    }
+};
+
 static QString quotedColumn( QString name )
 {
     return "\"" + name.replace("\"", "\"\"") + "\"";
@@ -90,12 +136,21 @@ QgsVirtualLayerProvider::QgsVirtualLayerProvider( QString const &uri )
     foreach ( const SourceLayer& layer, mLayers ) {
         if ( layer.layer ) {
             connect( layer.layer, SIGNAL(layerDeleted()), this, SLOT(onLayerDeleted()) );
+            connect( layer.layer, SIGNAL(editingStopped()), this, SLOT(onSourceChanged()) );
+            connect( layer.layer, SIGNAL(dataChanged()), this, SLOT(onSourceChanged()) );
+            connect( layer.layer->dataProvider(), SIGNAL(dataChanged()), this, SLOT(onSourceChanged()) );
         }
     }
 
     if (mDefinition.geometrySrid() != -1 ) {
         mCrs = QgsCoordinateReferenceSystem( mDefinition.geometrySrid() );
     }
+
+    if ( mValid ) {
+        bool has_geometry = !mDefinition.geometryField().isEmpty() && mDefinition.geometryField() != "*no*";
+        mStatisticsTask.reset( new QgsVirtualLayerStatistics( mPath, mTableName, has_geometry ? mDefinition.geometryField() : QString(), mMaterialization ) );
+        connect( mStatisticsTask.data(), SIGNAL(finished()), this, SLOT(onStatisticsComputed()) );
+    }
 }
 
 bool QgsVirtualLayerProvider::loadSourceLayers()
@@ -118,9 +173,23 @@ bool QgsVirtualLayerProvider::loadSourceLayers()
             mLayers << SourceLayer(layer.provider(), layer.source(), layer.name(), layer.encoding() );
         }
     }
+    initSourceStamp();
     return true;
 }
 
+void QgsVirtualLayerProvider::initSourceStamp()
+{
+    mSourceStamp = QSharedPointer<QgsVirtualLayerSourceStamp>( new QgsVirtualLayerSourceStamp() );
+    foreach ( const SourceLayer& layer, mLayers ) {
+        if ( layer.layer ) {
+            mSourceStamp->addLayer( layer.layer->id() );
+        }
+        else {
+            mSourceStamp->addSource( layer.provider, layer.source );
+        }
+    }
+}
+
 bool QgsVirtualLayerProvider::openIt()
 {
     spatialite_init(0);
@@ -138,6 +207,8 @@ bool QgsVirtualLayerProvider::openIt()
         return false;
     }
     mSqlite.reset(db);
+    mPool = QSharedPointer<Sqlite::ConnectionPool>( new Sqlite::ConnectionPool( mPath ) );
+    QgsVirtualLayerMetaCache::init( mSqlite.get() );
 
     // load source layers
     if (!loadSourceLayers()) {
@@ -164,6 +235,31 @@ bool QgsVirtualLayerProvider::openIt()
     }
     else {
         mTableName = "_view";
+
+        // materialization and spatial index are enabled if their tables have been created
+        bool has_table = false, has_index = false;
+        {
+            Sqlite::Query q( mSqlite.get(), "SELECT name FROM sqlite_master WHERE name=? OR name=?" );
+            q.bind( QgsVirtualLayerMaterialization::TABLE ).bind( QgsVirtualLayerViewIndex::TABLE );
+            while ( q.step() == SQLITE_ROW ) {
+                if ( q.column_text(0) == QgsVirtualLayerMaterialization::TABLE ) {
+                    has_table = true;
+                }
+                else {
+                    has_index = true;
+                }
+            }
+        }
+        bool has_geometry = mDefinition.geometryField() != "*no*";
+        if ( has_table ) {
+            mDefinition.setMaterialized( true );
+            mMaterialization = QSharedPointer<QgsVirtualLayerMaterialization>( new QgsVirtualLayerMaterialization( mPath, mDefinition.uid(), has_geometry ? mDefinition.geometryField() : QString(), mSourceStamp ) );
+            mTableName = QgsVirtualLayerMaterialization::TABLE;
+        }
+        else if ( has_index && !mDefinition.uid().isNull() && has_geometry ) {
+            mDefinition.setSpatialIndex( true );
+            mViewIndex = QSharedPointer<QgsVirtualLayerViewIndex>( new QgsVirtualLayerViewIndex( mPath, mDefinition.uid(), mDefinition.geometryField(), mSourceStamp ) );
+        }
     }
 
     return true;
@@ -226,29 +322,26 @@ bool QgsVirtualLayerProvider::createIt()
     }
 
     mPath = mDefinition.uri();
-    // use a temporary file if needed
+    // temporary layers live in a named in-memory database, shared by the connections of this process
+    // it lasts as long as a connection to it is open
     if ( mPath.isEmpty() ) {
-        mTempFile.reset( new QTemporaryFile() );
-        mTempFile->open();
-        // The spatialite QGIS provider has a strange behaviour when the same filename is used, even after closing and re-opening (bug #12266)
-        // handles are not freed. It results in tables that are not found, because it is still pointing on an old version of the file (in memory ?)
-        // We then add something changing to the filename to make sure it is unique
-        mPath = mTempFile->fileName() + QString("%1").arg(mNonce++);
-        mTempFile->close();
+        mPath = QString( "file:_vlayer%1?mode=memory&cache=shared" ).arg( mNonce++ );
     }
 
     spatialite_init(0);
 
     sqlite3* db;
     // open and create if it does not exist
-    int r = sqlite3_open( mPath.toUtf8().constData(), &db );
+    int r = sqlite3_open_v2( mPath.toUtf8().constData(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL );
     if ( r ) {
         PROVIDER_ERROR( QString( sqlite3_errmsg(db) ) );
         return false;
     }
     mSqlite.reset(db);
+    mPool = QSharedPointer<Sqlite::ConnectionPool>( new Sqlite::ConnectionPool( mPath ) );
     resetSqlite();
     initMetadata( mSqlite.get() );
+    QgsVirtualLayerMetaCache::init( mSqlite.get() );
 
     bool noGeometry = false;
 
@@ -266,12 +359,36 @@ bool QgsVirtualLayerProvider::createIt()
         return false;
     }
 
+    // open embedded sources in parallel, the virtual tables then get their providers from the registry
+    QList<EmbeddedSource> embedded;
+    foreach ( const SourceLayer& layer, mLayers ) {
+        if ( !layer.layer ) {
+            EmbeddedSource s;
+            s.provider = layer.provider;
+            s.source = layer.source;
+            s.encoding = layer.encoding;
+            embedded << s;
+        }
+    }
+    AcquiredProviders opened;
+    if ( embedded.size() > 1 ) {
+        opened << QtConcurrent::blockingMapped<QList<QgsVectorDataProvider*> >( embedded, OpenEmbeddedSource() );
+    }
+
     // now create virtual tables based on layers
     for ( int i = 0; i < mLayers.size(); i++ ) {
         QgsVectorLayer* vlayer = mLayers.at(i).layer;
         QString vname = mLayers.at(i).name;
+        // module options
+        QString options;
+        if ( mDefinition.isCached( vname ) ) {
+            options += ",cache=1";
+        }
+        if ( mDefinition.isPrefetched( vname ) ) {
+            options += ",prefetch=1";
+        }
         if ( vlayer ) {
-            QString createStr = QString("DROP TABLE IF EXISTS \"%1\"; CREATE VIRTUAL TABLE \"%1\" USING QgsVLayer(%2);").arg(vname).arg(vlayer->id());
+            QString createStr = QString("DROP TABLE IF EXISTS \"%1\"; CREATE VIRTUAL TABLE \"%1\" USING QgsVLayer(%2%3);").arg(vname).arg(vlayer->id()).arg(options);
             Sqlite::Query::exec( mSqlite.get(), createStr );
         }
         else {
@@ -282,10 +399,11 @@ bool QgsVirtualLayerProvider::createIt()
             // double each single quote
             source.replace( "'", "''" );
             QString encoding = mLayers.at(i).encoding;
-            QString createStr = QString( "DROP TABLE IF EXISTS \"%1\"; CREATE VIRTUAL TABLE \"%1\" USING QgsVLayer('%2','%4',%3)")
+            QString createStr = QString( "DROP TABLE IF EXISTS \"%1\"; CREATE VIRTUAL TABLE \"%1\" USING QgsVLayer('%2','%5',%3%4)")
                 .arg(vname)
                 .arg(provider)
                 .arg(encoding)
+                .arg(options)
                 .arg(source); // source must be the last argument here, since it can contains '%x' strings that would be replaced
             Sqlite::Query::exec( mSqlite.get(), createStr );
         }
@@ -298,6 +416,10 @@ bool QgsVirtualLayerProvider::createIt()
             QString tableName = q.column_text(0);
             QString columnName = q.column_text(1);
             QString columnType = q.column_text(2);
+            if ( columnName == "*pk*" || columnName == "*count*" ) {
+                // not columns, but information about the table
+                continue;
+            }
             if ( columnName != "*geometry*" ) {
                 QVariant::Type t = QVariant::nameToType( columnType.toUtf8().constData() );
                 refTables[tableName] << QgsSql::ColumnType( columnName, t );
@@ -446,14 +568,39 @@ bool QgsVirtualLayerProvider::createIt()
         mDefinition.setGeometryWkbType( QGis::WKBNoGeometry );
     }
 
+    if ( mDefinition.uri().isEmpty() ) {
+        // reference systems of the output, and the ones used by the query
+        QList<long> srids;
+        srids << reqGeometryField.srid();
+        if ( queryTree ) {
+            srids << QgsSql::referencedSrids( *queryTree );
+        }
+        insertSrids( srids );
+    }
+
+    if ( mDefinition.isMaterialized() && mTableName == "_view" ) {
+        // rows are stored on the first read, the table has its own spatial index
+        QString geometryField = noGeometry ? QString() : mDefinition.geometryField();
+        QgsVirtualLayerMaterialization::create( mSqlite.get(), mDefinition.uid(), geometryField );
+        mMaterialization = QSharedPointer<QgsVirtualLayerMaterialization>( new QgsVirtualLayerMaterialization( mPath, mDefinition.uid(), geometryField, mSourceStamp ) );
+        mTableName = QgsVirtualLayerMaterialization::TABLE;
+    }
+    // only views are indexed, single tables are read through the index of their source
+    else if ( mDefinition.hasSpatialIndex() && mTableName == "_view" && !mDefinition.uid().isNull() && !noGeometry ) {
+        QgsVirtualLayerViewIndex::create( mSqlite.get() );
+        mViewIndex = QSharedPointer<QgsVirtualLayerViewIndex>( new QgsVirtualLayerViewIndex( mPath, mDefinition.uid(), mDefinition.geometryField(), mSourceStamp ) );
+    }
+
     return true;
 }
 
 QgsVirtualLayerProvider::~QgsVirtualLayerProvider()
 {
-    if ( mTempFile ) {
-        // if we have been using a temporary file, delete it (the one with the nonce)
-        QFile::remove( mPath );
+    // stop any build of the index or scan of the table before the database is closed
+    mViewIndex.clear();
+    mStatisticsTask.reset();
+    if ( mPool ) {
+        mPool->clear();
     }
 }
 
@@ -475,18 +622,41 @@ void QgsVirtualLayerProvider::resetSqlite()
         sql += "DELETE FROM _tables;";
         sql += "DELETE FROM _columns;";
         sql += "DROP TABLE IF EXISTS _meta;";
+        sql += "DROP TABLE IF EXISTS _meta_cache;";
+        sql += QString( "DROP TABLE IF EXISTS %1;" ).arg( QgsVirtualLayerViewIndex::TABLE );
+        sql += QString( "DROP TABLE IF EXISTS %1;" ).arg( QgsVirtualLayerMaterialization::TABLE );
+        sql += QString( "DROP TABLE IF EXISTS %1;" ).arg( QgsVirtualLayerMaterialization::INDEX_TABLE );
     }
     bool has_spatialrefsys = false;
     {
         Sqlite::Query q( mSqlite.get(), "SELECT name FROM sqlite_master WHERE name='spatial_ref_sys'" );
         has_spatialrefsys = q.step() == SQLITE_ROW;
     }
+    if (!has_spatialrefsys && mDefinition.uri().isEmpty()) {
+        // temporary layer: no reference systems, the ones in use are inserted afterwards
+        // (the mode argument needs Spatialite 4.1)
+        try {
+            Sqlite::Query::exec( mSqlite.get(), sql + "SELECT InitSpatialMetadata(1, 'NONE');" );
+            return;
+        }
+        catch ( std::runtime_error& ) {
+        }
+    }
     if (!has_spatialrefsys) {
         sql += "SELECT InitSpatialMetadata(1);";
     }
     Sqlite::Query::exec( mSqlite.get(), sql );
 }
 
+void QgsVirtualLayerProvider::insertSrids( const QList<long>& srids )
+{
+    foreach ( long srid, srids ) {
+        if ( srid > 0 ) {
+            Sqlite::Query::exec( mSqlite.get(), QString( "SELECT InsertEpsgSrid(%1) WHERE NOT EXISTS (SELECT 1 FROM spatial_ref_sys WHERE srid=%1)" ).arg( srid ) );
+        }
+    }
+}
+
 void QgsVirtualLayerProvider::onLayerDeleted()
 {
     QgsVectorLayer* vl = static_cast<QgsVectorLayer*>(sender());
@@ -494,10 +664,19 @@ void QgsVirtualLayerProvider::onLayerDeleted()
         if (layer.layer && layer.layer->id() == vl->id() ) {
             // must drop the corresponding virtual table
             Sqlite::Query::exec( mSqlite.get(), QString("DROP TABLE \"%1\"").arg(layer.name) );
+            // pooled connections still refer to the layer
+            mPool->clear();
         }
     }    
 }
 
+void QgsVirtualLayerProvider::onSourceChanged()
+{
+    if ( mSourceStamp ) {
+        mSourceStamp->touch();
+    }
+}
+
 QgsAbstractFeatureSource* QgsVirtualLayerProvider::featureSource() const
 {
     return new QgsVirtualLayerFeatureSource( this );
@@ -515,7 +694,7 @@ QgsCoordinateReferenceSystem QgsVirtualLayerProvider::crs()
 
 QgsFeatureIterator QgsVirtualLayerProvider::getFeatures( const QgsFeatureRequest& request )
 {
-    return QgsFeatureIterator( new QgsVirtualLayerFeatureIterator( new QgsVirtualLayerFeatureSource( this ), false, request ) );
+    return QgsFeatureIterator( new QgsVirtualLayerFeatureIterator( new QgsVirtualLayerFeatureSource( this ), true, request ) );
 }
 
 QString QgsVirtualLayerProvider::subsetString()
@@ -528,6 +707,11 @@ QString QgsVirtualLayerProvider::subsetString()
 bool QgsVirtualLayerProvider::setSubsetString( QString theSQL, bool updateFeatureCount )
 {
     mSubset = theSQL;
+    // statistics and values depend on the subset
+    mCachedStatistics = false;
+    mMinimumValues.clear();
+    mMaximumValues.clear();
+    mUniqueValues.clear();
     return true;
 }
 
@@ -546,7 +730,7 @@ size_t QgsVirtualLayerProvider::layerCount() const
 
 long QgsVirtualLayerProvider::featureCount() const
 {
-    if ( !mCachedStatistics ) {
+    if ( !mCachedStatistics || mStatisticsStamp != sourceStamp() ) {
         updateStatistics();
     }
     return mFeatureCount;
@@ -554,39 +738,268 @@ long QgsVirtualLayerProvider::featureCount() const
 
 QgsRectangle QgsVirtualLayerProvider::extent()
 {
-    if ( !mCachedStatistics ) {
+    if ( !mCachedStatistics || mStatisticsStamp != sourceStamp() ) {
         updateStatistics();
     }
     return mExtent;
 }
 
+QString QgsVirtualLayerProvider::sourceStamp() const
+{
+    return mSourceStamp ? mSourceStamp->stamp() : QString();
+}
+
+QgsVectorDataProvider* QgsVirtualLayerProvider::acquireSourceProvider( const SourceLayer& layer ) const
+{
+    // the provider of an embedded layer is shared with its virtual table
+    if ( layer.layer ) {
+        return layer.layer->dataProvider();
+    }
+    return VLayerProviderRegistry::instance()->acquire( layer.provider, layer.source, layer.encoding );
+}
+
+void QgsVirtualLayerProvider::releaseSourceProvider( const SourceLayer& layer, QgsVectorDataProvider* provider ) const
+{
+    if ( !layer.layer ) {
+        VLayerProviderRegistry::instance()->release( provider );
+    }
+}
+
+QgsVectorDataProvider* QgsVirtualLayerProvider::copiedSourceProvider( const SourceLayer*& layer, QList<QgsSql::ColumnLineage>& lineage ) const
+{
+    // the layer must have one feature per feature of a source
+    QString table;
+    QScopedPointer<QgsSql::Node> tree;
+    if ( mDefinition.query().isEmpty() ) {
+        table = mTableName;
+    }
+    else {
+        QString err;
+        tree.reset( QgsSql::parseSql( mDefinition.query(), err ) );
+        if ( !tree || !QgsSql::isRowPreserving( *tree, table ) ) {
+            return 0;
+        }
+    }
+
+    layer = 0;
+    for ( int i = 0; i < mLayers.size(); i++ ) {
+        if ( mLayers[i].name.toLower() == table.toLower() ) {
+            layer = &mLayers[i];
+            break;
+        }
+    }
+    if ( !layer ) {
+        return 0;
+    }
+    QgsVectorDataProvider* provider = acquireSourceProvider( *layer );
+    if ( !provider ) {
+        return 0;
+    }
+
+    // columns of the virtual table
+    QgsSql::TableDefs defs;
+    const QgsFields& fields = provider->fields();
+    for ( int i = 0; i < fields.count(); i++ ) {
+        defs[table] << QgsSql::ColumnType( fields.at(i).name(), fields.at(i).type() );
+    }
+    if ( provider->geometryType() != QGis::WKBNoGeometry ) {
+        defs[table] << QgsSql::ColumnType( "geometry", provider->geometryType(), -1 );
+    }
+
+    if ( tree ) {
+        lineage = QgsSql::columnLineage( *tree, defs );
+    }
+    else {
+        foreach ( const QgsSql::ColumnType& c, defs[table] ) {
+            lineage << QgsSql::ColumnLineage( c.name(), table, c.name() );
+        }
+    }
+    return provider;
+}
+
+bool QgsVirtualLayerProvider::statisticsFromSources( bool hasGeometry ) const
+{
+    const SourceLayer* layer;
+    QList<QgsSql::ColumnLineage> lineage;
+    QgsVectorDataProvider* provider = copiedSourceProvider( layer, lineage );
+    if ( !provider ) {
+        return false;
+    }
+
+    // the extent needs the same geometries
+    bool geometryCopied = false;
+    foreach ( const QgsSql::ColumnLineage& l, lineage ) {
+        if ( l.isDirect() && l.name.toLower() == mDefinition.geometryField().toLower() && l.column.toLower() == "geometry" ) {
+            geometryCopied = true;
+        }
+    }
+    bool ok = false;
+    if ( !hasGeometry || geometryCopied ) {
+        long count;
+        QgsRectangle extent;
+        // a provider of the registry may be read by virtual tables in other threads
+        if ( layer->layer || !VLayerProviderRegistry::instance()->statistics( provider, count, extent ) ) {
+            count = provider->featureCount();
+            extent = hasGeometry ? provider->extent() : QgsRectangle();
+        }
+        if ( count >= 0 ) {
+            mFeatureCount = count;
+            if ( hasGeometry ) {
+                mExtent = extent;
+            }
+            ok = true;
+        }
+    }
+    releaseSourceProvider( *layer, provider );
+    return ok;
+}
+
+bool QgsVirtualLayerProvider::sourceValues( int index, ValueKind kind, QList<QVariant>& values, int limit ) const
+{
+    // values of a subset can only be computed by the query
+    if ( !mSubset.isEmpty() ) {
+        return false;
+    }
+    const SourceLayer* layer;
+    QList<QgsSql::ColumnLineage> lineage;
+    QgsVectorDataProvider* provider = copiedSourceProvider( layer, lineage );
+    if ( !provider ) {
+        return false;
+    }
+
+    bool ok = false;
+    foreach ( const QgsSql::ColumnLineage& l, lineage ) {
+        if ( !l.isDirect() || l.name.toLower() != mFields.at(index).name().toLower() ) {
+            continue;
+        }
+        int sourceIndex = provider->fieldNameIndex( l.column );
+        if ( sourceIndex == -1 ) {
+            break;
+        }
+        values.clear();
+        if ( kind == MinimumValue ) {
+            values << provider->minimumValue( sourceIndex );
+        }
+        else if ( kind == MaximumValue ) {
+            values << provider->maximumValue( sourceIndex );
+        }
+        else {
+            provider->uniqueValues( sourceIndex, values, limit );
+        }
+        ok = true;
+        break;
+    }
+    releaseSourceProvider( *layer, provider );
+    return ok;
+}
+
 void QgsVirtualLayerProvider::updateStatistics() const
 {
     bool has_geometry = !mDefinition.geometryField().isEmpty() && mDefinition.geometryField() != "*no*";
-    QString sql = QString( "SELECT Count(*)%1 FROM %2" )
-        .arg( has_geometry ? QString( ",Min(MbrMinX(%1)),Min(MbrMinY(%1)),Max(MbrMaxX(%1)),Max(MbrMaxY(%1))" ).arg( quotedColumn( mDefinition.geometryField()) ) : "" )
-        .arg( mTableName );
-    Sqlite::Query q(mSqlite.get(), sql );
-    if ( q.step() == SQLITE_ROW ) {
-        mFeatureCount = q.column_int64(0);
-        if (has_geometry) {
-            double x1, y1, x2, y2;
-            x1 = q.column_double(1);
-            y1 = q.column_double(2);
-            x2 = q.column_double(3);
-            y2 = q.column_double(4);
-            mExtent = QgsRectangle( q.column_double(1),
-                                    q.column_double(2),
-                                    q.column_double(3),
-                                    q.column_double(4) );
-        }
-        mCachedStatistics = true;
+    QString stamp = sourceStamp();
+    // statistics are saved for the whole layer, not for a subset of it
+    bool whole_layer = mSubset.isEmpty();
+
+    if ( whole_layer ) {
+        QString value;
+        if ( QgsVirtualLayerMetaCache::get( mSqlite.get(), "statistics", stamp, value ) ) {
+            QStringList l = value.split( ";" );
+            if ( l.size() == 5 ) {
+                mFeatureCount = l[0].toLongLong();
+                mExtent = QgsRectangle( l[1].toDouble(), l[2].toDouble(), l[3].toDouble(), l[4].toDouble() );
+                mStatisticsStamp = stamp;
+                mStatisticsSubset = mSubset;
+                mCachedStatistics = true;
+                return;
+            }
+        }
+        if ( statisticsFromSources( has_geometry ) ) {
+            mStatisticsStamp = stamp;
+            mStatisticsSubset = mSubset;
+            mCachedStatistics = true;
+            saveStatistics( stamp );
+            return;
+        }
+    }
+
+    // the query has to be evaluated, which is done in the background
+    estimateStatistics( has_geometry );
+    mStatisticsStamp = stamp;
+    mStatisticsSubset = mSubset;
+    mCachedStatistics = true;
+    if ( mStatisticsTask ) {
+        mStatisticsTask->compute( mSubset, stamp );
     }
 }
 
+void QgsVirtualLayerProvider::estimateStatistics( bool hasGeometry ) const
+{
+    // unknown count
+    mFeatureCount = -1;
+    mExtent = QgsRectangle();
+    if ( !hasGeometry ) {
+        return;
+    }
+    // union of the extents of the sources in the layer reference system
+    try {
+        Sqlite::Query q( mSqlite.get(), "SELECT Min(s.extent_min_x), Min(s.extent_min_y), Max(s.extent_max_x), Max(s.extent_max_y) "
+                         "FROM virts_geometry_columns_statistics s JOIN virts_geometry_columns g ON g.virt_name = s.virt_name "
+                         "WHERE g.srid = ?" );
+        q.bind( (qint64)mDefinition.geometrySrid() );
+        if ( q.step() == SQLITE_ROW && sqlite3_column_type( q.stmt(), 0 ) != SQLITE_NULL ) {
+            mExtent = QgsRectangle( q.column_double(0), q.column_double(1), q.column_double(2), q.column_double(3) );
+        }
+    }
+    catch ( std::runtime_error& e ) {
+        QgsMessageLog::logMessage( e.what(), QObject::tr( "VLayer" ) );
+    }
+}
+
+void QgsVirtualLayerProvider::saveStatistics( const QString& stamp ) const
+{
+    QString value = QString( "%1;%2;%3;%4;%5" )
+        .arg( mFeatureCount )
+        .arg( mExtent.xMinimum(), 0, 'g', 17 )
+        .arg( mExtent.yMinimum(), 0, 'g', 17 )
+        .arg( mExtent.xMaximum(), 0, 'g', 17 )
+        .arg( mExtent.yMaximum(), 0, 'g', 17 );
+    try {
+        QgsVirtualLayerMetaCache::put( mSqlite.get(), "statistics", stamp, value );
+    }
+    catch ( std::runtime_error& e ) {
+        QgsMessageLog::logMessage( e.what(), QObject::tr( "VLayer" ) );
+    }
+}
+
+void QgsVirtualLayerProvider::onStatisticsComputed()
+{
+    QString subset, stamp;
+    qint64 count;
+    QgsRectangle extent;
+    // results of a previous subset or state of the sources are dropped
+    if ( !mStatisticsTask->result( subset, stamp, count, extent ) || subset != mSubset || stamp != sourceStamp() ) {
+        return;
+    }
+    mFeatureCount = count;
+    mExtent = extent;
+    mStatisticsStamp = stamp;
+    mStatisticsSubset = mSubset;
+    mCachedStatistics = true;
+    if ( subset.isEmpty() ) {
+        saveStatistics( stamp );
+    }
+    emit statisticsReady();
+    // layers ask for the new extent
+    emit fullExtentCalculated();
+}
+
 void QgsVirtualLayerProvider::updateExtents()
 {
-    //    mSpatialite->updateExtents();
+    // called by layers on fullExtentCalculated(): statistics still current must be kept,
+    // a new computation would end with the same signal
+    if ( mStatisticsStamp != sourceStamp() || mStatisticsSubset != mSubset ) {
+        mCachedStatistics = false;
+    }
 }
 
 const QgsFields & QgsVirtualLayerProvider::fields() const
@@ -594,19 +1007,124 @@ const QgsFields & QgsVirtualLayerProvider::fields() const
     return mFields;
 }
 
+void QgsVirtualLayerProvider::checkValuesCache() const
+{
+    QString stamp = sourceStamp();
+    if ( mValuesStamp != stamp ) {
+        mMinimumValues.clear();
+        mMaximumValues.clear();
+        mUniqueValues.clear();
+        mValuesStamp = stamp;
+    }
+}
+
+QList<QVariant> QgsVirtualLayerProvider::queryValues( const QString& select, int index, int limit ) const
+{
+    if ( mMaterialization ) {
+        mMaterialization->refresh();
+    }
+
+    QString sql = QString( "SELECT %1 FROM %2" ).arg( select ).arg( mTableName );
+    if ( !mSubset.isEmpty() ) {
+        sql += " WHERE " + mSubset;
+    }
+    if ( limit >= 0 ) {
+        sql += QString( " LIMIT %1" ).arg( limit );
+    }
+
+    QList<QVariant> values;
+    QgsVirtualLayerFeatureIterator::ColumnReader reader = QgsVirtualLayerFeatureIterator::columnReader( mFields.at(index).type() );
+    std::unique_ptr<Sqlite::Connection> connection = mPool->acquire();
+    Sqlite::Query* q = connection->take( sql );
+    int r;
+    while ( ( r = q->step() ) == SQLITE_ROW ) {
+        values << reader( q->stmt(), 0 );
+    }
+    // partial values must not be cached
+    QString error = r == SQLITE_DONE ? QString() : QString( sqlite3_errmsg( connection->get() ) );
+    connection->giveBack( sql, q );
+    mPool->release( std::move( connection ) );
+    if ( !error.isNull() ) {
+        throw std::runtime_error( error.toLocal8Bit().constData() );
+    }
+    return values;
+}
+
 QVariant QgsVirtualLayerProvider::minimumValue( int index )
 {
-    return 0;
+    if ( index < 0 || index >= mFields.count() ) {
+        return QVariant();
+    }
+    checkValuesCache();
+    if ( !mMinimumValues.contains( index ) ) {
+        try {
+            QList<QVariant> values;
+            if ( !sourceValues( index, MinimumValue, values ) ) {
+                values = queryValues( QString( "Min(%1)" ).arg( quotedColumn( mFields.at(index).name() ) ), index );
+            }
+            mMinimumValues[index] = values.isEmpty() ? QVariant() : values[0];
+        }
+        catch ( std::runtime_error& e ) {
+            PROVIDER_ERROR( e.what() );
+            return QVariant();
+        }
+    }
+    return mMinimumValues[index];
 }
 
 QVariant QgsVirtualLayerProvider::maximumValue( int index )
 {
-    return 0;
+    if ( index < 0 || index >= mFields.count() ) {
+        return QVariant();
+    }
+    checkValuesCache();
+    if ( !mMaximumValues.contains( index ) ) {
+        try {
+            QList<QVariant> values;
+            if ( !sourceValues( index, MaximumValue, values ) ) {
+                values = queryValues( QString( "Max(%1)" ).arg( quotedColumn( mFields.at(index).name() ) ), index );
+            }
+            mMaximumValues[index] = values.isEmpty() ? QVariant() : values[0];
+        }
+        catch ( std::runtime_error& e ) {
+            PROVIDER_ERROR( e.what() );
+            return QVariant();
+        }
+    }
+    return mMaximumValues[index];
 }
 
 void QgsVirtualLayerProvider::uniqueValues( int index, QList < QVariant > &uniqueValues, int limit )
 {
-    //    return mSpatialite->uniqueValues( index, uniqueValues, limit );
+    uniqueValues.clear();
+    if ( index < 0 || index >= mFields.count() ) {
+        return;
+    }
+    checkValuesCache();
+    // a list shorter than its limit holds all the values
+    bool cached = mUniqueValues.contains( index );
+    if ( cached ) {
+        const QPair<int, QList<QVariant> >& c = mUniqueValues[index];
+        bool complete = c.first < 0 || c.second.size() < c.first;
+        cached = complete || (limit >= 0 && limit <= c.first);
+    }
+    if ( !cached ) {
+        try {
+            QList<QVariant> values;
+            if ( !sourceValues( index, UniqueValues, values, limit ) ) {
+                values = queryValues( QString( "DISTINCT %1" ).arg( quotedColumn( mFields.at(index).name() ) ), index, limit );
+            }
+            mUniqueValues[index] = qMakePair( limit, values );
+        }
+        catch ( std::runtime_error& e ) {
+            PROVIDER_ERROR( e.what() );
+            return;
+        }
+    }
+    uniqueValues = mUniqueValues[index].second;
+    if ( limit >= 0 && uniqueValues.size() > limit ) {
+        uniqueValues = uniqueValues.mid( 0, limit );
+    }
 }
 
 bool QgsVirtualLayerProvider::isValid()
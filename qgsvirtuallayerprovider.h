@@ -17,7 +17,9 @@ email                : hugo dot mercier at oslandia dot com
 #ifndef QGSVIRTUAL_LAYER_PROVIDER_H
 #define QGSVIRTUAL_LAYER_PROVIDER_H
 
-#include <QTemporaryFile>
+#include <QSharedPointer>
+#include <QScopedPointer>
+#include <QMap>
 
 #include <qgsvectordataprovider.h>
 
@@ -26,8 +28,13 @@ email                : hugo dot mercier at oslandia dot com
 #include "qgsvirtuallayerdefinition.h"
 
 #include "sqlite_helper.h"
+#include "qgssql.h"
 
 class QgsVirtualLayerFeatureIterator;
+class QgsVirtualLayerSourceStamp;
+class QgsVirtualLayerViewIndex;
+class QgsVirtualLayerMaterialization;
+class QgsVirtualLayerStatistics;
 
 class QgsVirtualLayerProvider: public QgsVectorDataProvider
 {
@@ -152,6 +159,19 @@ class QgsVirtualLayerProvider: public QgsVectorDataProvider
 
     QgsScopedSqlite mSqlite;
 
+    // read connections used by feature iterators, shared with feature sources
+    QSharedPointer<Sqlite::ConnectionPool> mPool;
+
+    // state of the sources, for values derived from them
+    QSharedPointer<QgsVirtualLayerSourceStamp> mSourceStamp;
+    void initSourceStamp();
+
+    // spatial index of the query output, if enabled
+    QSharedPointer<QgsVirtualLayerViewIndex> mViewIndex;
+
+    // table storing the query output, if enabled
+    QSharedPointer<QgsVirtualLayerMaterialization> mMaterialization;
+
     // underlying vector layers
     struct SourceLayer
     {
@@ -175,16 +195,13 @@ class QgsVirtualLayerProvider: public QgsVectorDataProvider
 
     bool mValid;
 
-    // temporary file used for temporary virtual layer
-    QScopedPointer<QTemporaryFile> mTempFile;
-
     QString mTableName;
 
     QgsFields mFields;
 
     QgsCoordinateReferenceSystem mCrs;
 
-    // nonce used for temporary file
+    // nonce used for the names of temporary databases
     static int mNonce;
 
     QgsVirtualLayerDefinition mDefinition;
@@ -193,20 +210,63 @@ class QgsVirtualLayerProvider: public QgsVectorDataProvider
 
     void resetSqlite();
 
+    // add reference systems missing from spatial_ref_sys
+    void insertSrids( const QList<long>& srids );
+
     mutable bool mCachedStatistics;
     mutable qint64 mFeatureCount;
     mutable QgsRectangle mExtent;
+    // stamp of the sources and subset the statistics have been computed from
+    mutable QString mStatisticsStamp;
+    mutable QString mStatisticsSubset;
 
+    // exact statistics, or an estimate until the scan of the table is over
     void updateStatistics() const;
+    // statistics read from the source of a single table query, without evaluating it
+    bool statisticsFromSources( bool hasGeometry ) const;
+    // statistics known before the table is scanned
+    void estimateStatistics( bool hasGeometry ) const;
+    void saveStatistics( const QString& stamp ) const;
+    // scan of the table in the background
+    QScopedPointer<QgsVirtualLayerStatistics> mStatisticsTask;
+    QString sourceStamp() const;
+
+    // values of fields computed by SQL aggregates, by field index
+    mutable QMap<int, QVariant> mMinimumValues;
+    mutable QMap<int, QVariant> mMaximumValues;
+    // limit of the query and unique values
+    mutable QMap<int, QPair<int, QList<QVariant> > > mUniqueValues;
+    // stamp of the sources the values have been computed from
+    mutable QString mValuesStamp;
+    void checkValuesCache() const;
+    QList<QVariant> queryValues( const QString& select, int index, int limit = -1 ) const;
+
+    // provider of a source layer, to be released afterwards
+    QgsVectorDataProvider* acquireSourceProvider( const SourceLayer& layer ) const;
+    void releaseSourceProvider( const SourceLayer& layer, QgsVectorDataProvider* provider ) const;
+    // provider of the source of a layer copying features of a single source, with the lineage of the layer columns
+    // null for other layers
+    QgsVectorDataProvider* copiedSourceProvider( const SourceLayer*& layer, QList<QgsSql::ColumnLineage>& lineage ) const;
+
+    // values of a field copied from a source field, asked to the source provider
+    enum ValueKind { MinimumValue, MaximumValue, UniqueValues };
+    bool sourceValues( int index, ValueKind kind, QList<QVariant>& values, int limit = -1 ) const;
 
     bool openIt();
     bool createIt();
     bool loadSourceLayers();
 
     friend class QgsVirtualLayerFeatureIterator;
+    friend class QgsVirtualLayerFeatureSource;
+
+signals:
+    //! Emitted when the exact feature count and extent are known, after estimates have been returned
+    void statisticsReady();
 
 private slots:
     void onLayerDeleted();
+    void onSourceChanged();
+    void onStatisticsComputed();
 };
 
 #endif
@@ -0,0 +1,165 @@
+/***************************************************************************
+                   qgsvirtuallayerstatistics.cpp
+          Background computation of the statistics of a virtual layer
+begin                : Oct 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdexcept>
+
+#include <qgsmessagelog.h>
+
+#include "qgsvirtuallayerstatistics.h"
+#include "qgsvirtuallayermaterialization.h"
+#include "sqlite_helper.h"
+
+static QString quotedColumn( QString name )
+{
+    return "\"" + name.replace("\"", "\"\"") + "\"";
+}
+
+QgsVirtualLayerStatistics::QgsVirtualLayerStatistics( const QString& path, const QString& table, const QString& geometryField, QSharedPointer<QgsVirtualLayerMaterialization> materialization )
+    : mPath( path )
+    , mTable( table )
+    , mGeometryField( geometryField )
+    , mMaterialization( materialization )
+    , mRequest( 0 )
+    , mDone( 0 )
+    , mRunning( false )
+    , mDb( 0 )
+    , mStop( false )
+    , mValid( false )
+    , mCount( 0 )
+{
+}
+
+QgsVirtualLayerStatistics::~QgsVirtualLayerStatistics()
+{
+    {
+        QMutexLocker lock( &mMutex );
+        mStop = true;
+        if ( mDb ) {
+            sqlite3_interrupt( mDb );
+        }
+    }
+    wait();
+}
+
+void QgsVirtualLayerStatistics::compute( const QString& subset, const QString& stamp )
+{
+    QMutexLocker lock( &mMutex );
+    if ( mStop ) {
+        return;
+    }
+    mSubset = subset;
+    mStamp = stamp;
+    mRequest++;
+    if ( mRunning ) {
+        // the thread picks the new request up once the current one is interrupted
+        if ( mDb ) {
+            sqlite3_interrupt( mDb );
+        }
+        return;
+    }
+    // the thread may still be returning from a previous run
+    wait();
+    mRunning = true;
+    start( QThread::LowPriority );
+}
+
+bool QgsVirtualLayerStatistics::result( QString& subset, QString& stamp, qint64& count, QgsRectangle& extent ) const
+{
+    QMutexLocker lock( &mMutex );
+    if ( !mValid || mDone != mRequest ) {
+        return false;
+    }
+    subset = mResultSubset;
+    stamp = mResultStamp;
+    count = mCount;
+    extent = mExtent;
+    return true;
+}
+
+void QgsVirtualLayerStatistics::run()
+{
+    bool hasGeometry = !mGeometryField.isEmpty();
+    try {
+        QgsScopedSqlite db( Sqlite::open( mPath ) );
+        for ( ;; ) {
+            QString subset, stamp;
+            int request;
+            {
+                QMutexLocker lock( &mMutex );
+                if ( mStop || mDone == mRequest ) {
+                    mRunning = false;
+                    return;
+                }
+                subset = mSubset;
+                stamp = mStamp;
+                request = mRequest;
+                mDb = db.get();
+            }
+
+            bool valid = false;
+            qint64 count = 0;
+            QgsRectangle extent;
+            try {
+                if ( mMaterialization ) {
+                    mMaterialization->refresh();
+                }
+                QString sql = QString( "SELECT Count(*)%1 FROM %2" )
+                    .arg( hasGeometry ? QString( ",Min(MbrMinX(%1)),Min(MbrMinY(%1)),Max(MbrMaxX(%1)),Max(MbrMaxY(%1))" ).arg( quotedColumn( mGeometryField ) ) : "" )
+                    .arg( mTable );
+                if ( !subset.isEmpty() ) {
+                    sql += " WHERE " + subset;
+                }
+                Sqlite::Query q( db.get(), sql );
+                if ( q.step() == SQLITE_ROW ) {
+                    count = q.column_int64(0);
+                    if ( hasGeometry ) {
+                        extent = QgsRectangle( q.column_double(1),
+                                               q.column_double(2),
+                                               q.column_double(3),
+                                               q.column_double(4) );
+                    }
+                    valid = true;
+                }
+                else {
+                    throw std::runtime_error( sqlite3_errmsg( db.get() ) );
+                }
+            }
+            catch ( std::runtime_error& e ) {
+                // an interrupted computation has been replaced by another one
+                QMutexLocker lock( &mMutex );
+                if ( !mStop && request == mRequest ) {
+                    QgsMessageLog::logMessage( QString( "Cannot compute the layer statistics: %1" ).arg( e.what() ), QObject::tr( "VLayer" ) );
+                }
+            }
+
+            QMutexLocker lock( &mMutex );
+            mDb = 0;
+            mDone = request;
+            mValid = valid;
+            mResultSubset = subset;
+            mResultStamp = stamp;
+            mCount = count;
+            mExtent = extent;
+        }
+    }
+    catch ( std::runtime_error& e ) {
+        QMutexLocker lock( &mMutex );
+        mDb = 0;
+        mRunning = false;
+        QgsMessageLog::logMessage( QString( "Cannot compute the layer statistics: %1" ).arg( e.what() ), QObject::tr( "VLayer" ) );
+    }
+}
@@ -0,0 +1,78 @@
+/***************************************************************************
+                   qgsvirtuallayerstatistics.h
+          Background computation of the statistics of a virtual layer
+begin                : Oct 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+#ifndef QGSVIRTUALLAYER_STATISTICS_H
+#define QGSVIRTUALLAYER_STATISTICS_H
+
+#include <QThread>
+#include <QMutex>
+#include <QSharedPointer>
+
+#include <qgsrectangle.h>
+
+struct sqlite3;
+class QgsVirtualLayerMaterialization;
+
+/**
+ * Feature count and extent of a virtual layer, computed by a scan of its table
+ * on a connection of its own.
+ *
+ * A new computation interrupts the running one. The finished() signal of the thread
+ * is emitted when there is no computation left.
+ */
+class QgsVirtualLayerStatistics : public QThread
+{
+public:
+    QgsVirtualLayerStatistics( const QString& path, const QString& table, const QString& geometryField, QSharedPointer<QgsVirtualLayerMaterialization> materialization );
+
+    //! Interrupts a running computation
+    ~QgsVirtualLayerStatistics();
+
+    //! Start the computation for a subset of the table and a stamp of its sources
+    void compute( const QString& subset, const QString& stamp );
+
+    //! Result of the last computation, false if it failed or has been replaced by another one
+    bool result( QString& subset, QString& stamp, qint64& count, QgsRectangle& extent ) const;
+
+protected:
+    virtual void run() override;
+
+private:
+    QString mPath;
+    QString mTable;
+    QString mGeometryField;
+    QSharedPointer<QgsVirtualLayerMaterialization> mMaterialization;
+
+    mutable QMutex mMutex;
+    // last requested computation
+    QString mSubset;
+    QString mStamp;
+    int mRequest;
+    // last computation done
+    int mDone;
+    bool mRunning;
+    // connection of the running computation, if any
+    sqlite3* mDb;
+    bool mStop;
+
+    bool mValid;
+    QString mResultSubset;
+    QString mResultStamp;
+    qint64 mCount;
+    QgsRectangle mExtent;
+};
+
+#endif
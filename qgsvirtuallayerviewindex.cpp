@@ -0,0 +1,141 @@
+/***************************************************************************
+                   qgsvirtuallayerviewindex.cpp
+          Spatial index of the output of a virtual layer query
+begin                : Oct 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdexcept>
+
+#include <qgsmessagelog.h>
+
+#include "qgsvirtuallayerviewindex.h"
+#include "sqlite_helper.h"
+
+const char* QgsVirtualLayerViewIndex::TABLE = "_view_rtree";
+
+// key of the index stamp in the meta cache
+static const char* STAMP_KEY = "view_rtree";
+
+// how long the build waits for readers of the database to finish before committing (ms)
+static const int BUSY_TIMEOUT = 10000;
+
+static QString quotedColumn( QString name )
+{
+    return "\"" + name.replace("\"", "\"\"") + "\"";
+}
+
+QgsVirtualLayerViewIndex::QgsVirtualLayerViewIndex( const QString& path, const QString& uid, const QString& geometryField, QSharedPointer<QgsVirtualLayerSourceStamp> stamp )
+    : mPath( path )
+    , mUid( uid )
+    , mGeometryField( geometryField )
+    , mStamp( stamp )
+    , mBuildDb( 0 )
+    , mStop( false )
+{
+    // an index saved by a previous session may still be valid
+    if ( mStamp->isPersistent() ) {
+        try {
+            QgsScopedSqlite db( Sqlite::open( mPath ) );
+            QString value;
+            if ( QgsVirtualLayerMetaCache::get( db.get(), STAMP_KEY, mStamp->stamp(), value ) ) {
+                mIndexStamp = mStamp->stamp();
+            }
+        }
+        catch ( std::runtime_error& e ) {
+            QgsMessageLog::logMessage( e.what(), QObject::tr( "VLayer" ) );
+        }
+    }
+}
+
+QgsVirtualLayerViewIndex::~QgsVirtualLayerViewIndex()
+{
+    {
+        QMutexLocker lock( &mMutex );
+        mStop = true;
+        if ( mBuildDb ) {
+            sqlite3_interrupt( mBuildDb );
+        }
+    }
+    wait();
+}
+
+void QgsVirtualLayerViewIndex::create( sqlite3* db )
+{
+    Sqlite::Query::exec( db, QString( "DROP TABLE IF EXISTS %1; CREATE VIRTUAL TABLE %1 USING rtree(id, minx, maxx, miny, maxy)" ).arg( TABLE ) );
+}
+
+bool QgsVirtualLayerViewIndex::isUsable()
+{
+    QString stamp = mStamp->stamp();
+    QMutexLocker lock( &mMutex );
+    if ( mIndexStamp == stamp ) {
+        return true;
+    }
+    // a failed build is not retried until the sources change
+    if ( !mStop && !isRunning() && mFailedStamp != stamp ) {
+        start( QThread::LowPriority );
+    }
+    return false;
+}
+
+QString QgsVirtualLayerViewIndex::candidates() const
+{
+    return QString( "%1 IN (SELECT id FROM %2 WHERE minx <= ?3 AND maxx >= ?1 AND miny <= ?4 AND maxy >= ?2)" )
+        .arg( quotedColumn( mUid ) )
+        .arg( TABLE );
+}
+
+void QgsVirtualLayerViewIndex::run()
+{
+    // sources changing during the build will trigger another one
+    QString stamp = mStamp->stamp();
+    try {
+        QgsScopedSqlite db( Sqlite::open( mPath ) );
+        sqlite3_busy_timeout( db.get(), BUSY_TIMEOUT );
+        {
+            QMutexLocker lock( &mMutex );
+            if ( mStop ) {
+                return;
+            }
+            mBuildDb = db.get();
+        }
+
+        QString geom = quotedColumn( mGeometryField );
+        try {
+            Sqlite::Query::exec( db.get(), "BEGIN" );
+            Sqlite::Query::exec( db.get(), QString( "DELETE FROM %1" ).arg( TABLE ) );
+            Sqlite::Query::exec( db.get(), QString( "INSERT INTO %1 SELECT %2, MbrMinX(%3), MbrMaxX(%3), MbrMinY(%3), MbrMaxY(%3) FROM _view WHERE %3 IS NOT NULL" )
+                                 .arg( TABLE )
+                                 .arg( quotedColumn( mUid ) )
+                                 .arg( geom ) );
+            QgsVirtualLayerMetaCache::put( db.get(), STAMP_KEY, stamp, QString() );
+            Sqlite::Query::exec( db.get(), "COMMIT" );
+        }
+        catch ( std::runtime_error& ) {
+            sqlite3_exec( db.get(), "ROLLBACK", NULL, NULL, NULL );
+            QMutexLocker lock( &mMutex );
+            mBuildDb = 0;
+            throw;
+        }
+
+        QMutexLocker lock( &mMutex );
+        mBuildDb = 0;
+        mIndexStamp = stamp;
+    }
+    catch ( std::runtime_error& e ) {
+        QMutexLocker lock( &mMutex );
+        mFailedStamp = stamp;
+        QgsMessageLog::logMessage( QString( "Cannot build the spatial index: %1" ).arg( e.what() ), QObject::tr( "VLayer" ) );
+    }
+}
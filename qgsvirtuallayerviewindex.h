@@ -0,0 +1,74 @@
+/***************************************************************************
+                   qgsvirtuallayerviewindex.h
+          Spatial index of the output of a virtual layer query
+begin                : Oct 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+#ifndef QGSVIRTUALLAYER_VIEW_INDEX_H
+#define QGSVIRTUALLAYER_VIEW_INDEX_H
+
+#include <QThread>
+#include <QMutex>
+#include <QSharedPointer>
+
+#include "qgsvirtuallayercache.h"
+
+struct sqlite3;
+
+/**
+ * R*Tree of the bounding boxes of the features returned by _view, keyed by uid
+ *
+ * The index is stored in the _view_rtree table of the virtual layer database.
+ * It is (re)built in a background thread each time it is requested while the sources
+ * have changed, and is not used until the build is over.
+ */
+class QgsVirtualLayerViewIndex : public QThread
+{
+public:
+    //! name of the index table
+    static const char* TABLE;
+
+    QgsVirtualLayerViewIndex( const QString& path, const QString& uid, const QString& geometryField, QSharedPointer<QgsVirtualLayerSourceStamp> stamp );
+
+    //! Interrupts a running build
+    ~QgsVirtualLayerViewIndex();
+
+    //! Create the (empty) index table
+    static void create( sqlite3* db );
+
+    //! Whether the index is up to date with the sources, if not a build is started
+    bool isUsable();
+
+    //! Predicate selecting the candidates intersecting the ?1,?2,?3,?4 rectangle
+    QString candidates() const;
+
+protected:
+    virtual void run() override;
+
+private:
+    QString mPath;
+    QString mUid;
+    QString mGeometryField;
+    QSharedPointer<QgsVirtualLayerSourceStamp> mStamp;
+
+    QMutex mMutex;
+    // stamp of the sources the index has been built from
+    QString mIndexStamp;
+    // stamp of the sources of the last failed build
+    QString mFailedStamp;
+    // connection of the running build, if any
+    sqlite3* mBuildDb;
+    bool mStop;
+};
+
+#endif
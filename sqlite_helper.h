@@ -6,6 +6,11 @@ extern "C" {
 }
 
 #include <memory>
+#include <vector>
+
+#include <QMutex>
+#include <QList>
+#include <QPair>
 
 // custom deleter for QgsSqliteHandle
 struct SqliteHandleDeleter
@@ -24,7 +29,8 @@ namespace Sqlite
         QgsScopedSqlite sqlite;
         int r;
         sqlite3* db;
-        r = sqlite3_open( path.toLocal8Bit().constData(), &db );
+        // file: URIs name in-memory databases of temporary layers
+        r = sqlite3_open_v2( path.toLocal8Bit().constData(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL );
         if (r) {
             throw std::runtime_error( sqlite3_errmsg(db) );
         }
@@ -32,6 +38,30 @@ namespace Sqlite
         return sqlite;
     };
 
+    // connections to a shared cache database fail with SQLITE_LOCKED while another one writes
+    // a table they read, a statement is then retried until the lock is released
+    static const int LOCK_TIMEOUT_MS = 30000;
+    static const int LOCK_SLEEP_MS = 5;
+
+    static bool is_locked( int r )
+    {
+        r &= 0xff;
+        return r == SQLITE_LOCKED || r == SQLITE_BUSY;
+    }
+
+    static int step( sqlite3_stmt* stmt )
+    {
+        // locks are taken when the statement starts, a statement that has returned rows is not restarted
+        bool started = sqlite3_stmt_busy( stmt ) != 0;
+        int r = sqlite3_step( stmt );
+        for ( int waited = 0; !started && is_locked( r ) && waited < LOCK_TIMEOUT_MS; waited += LOCK_SLEEP_MS ) {
+            sqlite3_reset( stmt );
+            sqlite3_sleep( LOCK_SLEEP_MS );
+            r = sqlite3_step( stmt );
+        }
+        return r;
+    }
+
     struct Query
     {
         Query( sqlite3* db, const QString& q ) : db_(db), nBind_(1)
@@ -49,7 +79,7 @@ namespace Sqlite
             sqlite3_finalize( stmt_ );
         }
 
-        int step() { return sqlite3_step(stmt_); }
+        int step() { return Sqlite::step(stmt_); }
 
         Query& bind( const QString& str, int idx )
         {
@@ -65,13 +95,59 @@ namespace Sqlite
             return bind( str, nBind_++ );
         }
 
-        static void exec( sqlite3* db, const QString& sql )
+        Query& bind( double v, int idx )
         {
-            char *errMsg = 0;
-            int r = sqlite3_exec( db, sql.toLocal8Bit().constData(), NULL, NULL, &errMsg );
+            int r = sqlite3_bind_double( stmt_, idx, v );
             if (r) {
-                QString err = QString( "Query execution error on %1: %2 - %3" ).arg(sql).arg(r).arg(errMsg);
-                throw std::runtime_error( err.toLocal8Bit().constData() );
+                throw std::runtime_error( sqlite3_errmsg(db_) );
+            }
+            return *this;
+        }
+        Query& bind( double v )
+        {
+            return bind( v, nBind_++ );
+        }
+
+        Query& bind( qint64 v, int idx )
+        {
+            int r = sqlite3_bind_int64( stmt_, idx, v );
+            if (r) {
+                throw std::runtime_error( sqlite3_errmsg(db_) );
+            }
+            return *this;
+        }
+        Query& bind( qint64 v )
+        {
+            return bind( v, nBind_++ );
+        }
+
+        static void exec( sqlite3* db, const QString& sql )
+        {
+            // statements are run one by one, so that a locked one is retried alone
+            QByteArray ba( sql.toLocal8Bit() );
+            const char* tail = ba.constData();
+            while ( *tail ) {
+                sqlite3_stmt* stmt = 0;
+                const char* start = tail;
+                int r = sqlite3_prepare_v2( db, start, -1, &stmt, &tail );
+                for ( int waited = 0; is_locked( r ) && waited < LOCK_TIMEOUT_MS; waited += LOCK_SLEEP_MS ) {
+                    sqlite3_sleep( LOCK_SLEEP_MS );
+                    r = sqlite3_prepare_v2( db, start, -1, &stmt, &tail );
+                }
+                if ( r == SQLITE_OK && stmt ) {
+                    while ( ( r = Sqlite::step( stmt ) ) == SQLITE_ROW ) {
+                    }
+                    if ( r == SQLITE_DONE ) {
+                        r = SQLITE_OK;
+                    }
+                }
+                if (r) {
+                    QString err = QString( "Query execution error on %1: %2 - %3" ).arg(sql).arg(r).arg(sqlite3_errmsg(db));
+                    sqlite3_finalize( stmt );
+                    throw std::runtime_error( err.toLocal8Bit().constData() );
+                }
+                // null for whitespace or comments
+                sqlite3_finalize( stmt );
             }
         }
 
@@ -131,6 +207,121 @@ namespace Sqlite
         sqlite3_stmt* stmt_;
         int nBind_;
     };
+
+    /**
+     * Connection with a cache of prepared statements
+     *
+     * Statements are taken out of the cache while in use and given back afterwards,
+     * the least recently used ones being finalized when the cache is full.
+     */
+    class Connection
+    {
+    public:
+        // maximum number of cached statements
+        static const int MAX_STATEMENTS = 16;
+
+        Connection( QgsScopedSqlite db ) : db_( std::move( db ) ) {}
+
+        ~Connection()
+        {
+            // statements must be finalized before the connection is closed
+            for ( int i = 0; i < statements_.size(); i++ ) {
+                delete statements_[i].second;
+            }
+        }
+
+        sqlite3* get() { return db_.get(); }
+
+        // take a statement out of the cache, or prepare it
+        Query* take( const QString& sql )
+        {
+            for ( int i = statements_.size() - 1; i >= 0; i-- ) {
+                if ( statements_[i].first == sql ) {
+                    Query* q = statements_[i].second;
+                    statements_.removeAt( i );
+                    return q;
+                }
+            }
+            return new Query( db_.get(), sql );
+        }
+
+        // give a statement taken with take() back to the cache
+        void giveBack( const QString& sql, Query* q )
+        {
+            // release locks held by the statement, bound values are kept
+            sqlite3_reset( q->stmt() );
+            statements_ << qMakePair( sql, q );
+            if ( statements_.size() > MAX_STATEMENTS ) {
+                delete statements_.takeFirst().second;
+            }
+        }
+
+    private:
+        QgsScopedSqlite db_;
+        // most recently used last
+        QList<QPair<QString, Query*> > statements_;
+    };
+
+    /**
+     * Pool of connections to a database
+     *
+     * Released connections are kept open, so that the next user gets them
+     * with their virtual tables connected and their statements prepared.
+     */
+    class ConnectionPool
+    {
+    public:
+        // maximum number of idle connections kept open
+        static const size_t MAX_IDLE = 4;
+
+        ConnectionPool( const QString& path ) : path_(path) {}
+
+        ~ConnectionPool()
+        {
+            clear();
+        }
+
+        // get a connection, opening a new one if none is idle
+        std::unique_ptr<Connection> acquire()
+        {
+            {
+                QMutexLocker lock( &mutex_ );
+                if ( !idle_.empty() ) {
+                    std::unique_ptr<Connection> c( idle_.back() );
+                    idle_.pop_back();
+                    return c;
+                }
+            }
+            return std::unique_ptr<Connection>( new Connection( open( path_ ) ) );
+        }
+
+        // give a connection back, statements not given back to it must have been finalized
+        void release( std::unique_ptr<Connection> c )
+        {
+            if ( !c ) {
+                return;
+            }
+            QMutexLocker lock( &mutex_ );
+            if ( idle_.size() < MAX_IDLE ) {
+                idle_.push_back( c.release() );
+            }
+        }
+
+        // close idle connections
+        void clear()
+        {
+            QMutexLocker lock( &mutex_ );
+            for ( size_t i = 0; i < idle_.size(); i++ ) {
+                delete idle_[i];
+            }
+            idle_.clear();
+        }
+
+    private:
+        QString path_;
+        QMutex mutex_;
+        std::vector<Connection*> idle_;
+    };
 }
 
 #endif
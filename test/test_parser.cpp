@@ -19,7 +19,10 @@ class TestSqlParser : public QObject
     void testParsing();
     void testParsing2();
     void testRefTables();
+    void testRefSrids();
     void testColumnTypes();
+    void testRowPreserving();
+    void testColumnLineage();
 };
 
 void TestSqlParser::initTestCase()
@@ -118,6 +121,17 @@ void TestSqlParser::testRefTables()
 }
 
 
+void TestSqlParser::testRefSrids()
+{
+    QString err;
+    QScopedPointer<QgsSql::Node> n( QgsSql::parseSql( "select st_transform(setsrid(geometry, 4326), 2154), round(a, 2), makepoint(x, y) from t", err ) );
+    QVERIFY( !n.isNull() );
+    QList<long> srids = QgsSql::referencedSrids( *n );
+    QVERIFY( srids.size() == 2 );
+    QVERIFY( srids.contains(4326) );
+    QVERIFY( srids.contains(2154) );
+}
+
 void TestSqlParser::testColumnTypes()
 {
     using namespace QgsSql;
@@ -310,5 +324,54 @@ void TestSqlParser::testColumnTypes()
     }
 }
 
+void TestSqlParser::testRowPreserving()
+{
+    QString err, table;
+    {
+        QScopedPointer<QgsSql::Node> n( QgsSql::parseSql( "select a, st_buffer(geometry, 1) as geom from t order by a", err ) );
+        QVERIFY( QgsSql::isRowPreserving( *n, table ) );
+        QVERIFY( table == "t" );
+    }
+    {
+        QScopedPointer<QgsSql::Node> n( QgsSql::parseSql( "select *, (select count(*) from t2) from t", err ) );
+        QVERIFY( QgsSql::isRowPreserving( *n, table ) );
+    }
+    const char* queries[] = { "select * from t where a > 0",
+                              "select a from t group by a",
+                              "select distinct a from t",
+                              "select * from t limit 10",
+                              "select count(*) from t",
+                              "select max(a) from t",
+                              "select * from t, t2",
+                              "select * from t union select * from t2",
+                              0 };
+    for ( int i = 0; queries[i]; i++ ) {
+        QScopedPointer<QgsSql::Node> n( QgsSql::parseSql( queries[i], err ) );
+        QVERIFY( !n.isNull() );
+        QVERIFY( !QgsSql::isRowPreserving( *n, table ) );
+    }
+}
+
+void TestSqlParser::testColumnLineage()
+{
+    QString err;
+    QgsSql::TableDefs t;
+    t["t"] << QgsSql::ColumnType( "a", QVariant::Int ) << QgsSql::ColumnType( "b", QVariant::String );
+    {
+        QScopedPointer<QgsSql::Node> n( QgsSql::parseSql( "select *, x.a as c, a+1 as d from t as x", err ) );
+        QList<QgsSql::ColumnLineage> l = QgsSql::columnLineage( *n, t );
+        QVERIFY( l.size() == 4 );
+        QVERIFY( l[0].isDirect() && l[0].name == "a" && l[0].column == "a" );
+        QVERIFY( l[1].isDirect() && l[1].name == "b" && l[1].column == "b" );
+        QVERIFY( l[2].isDirect() && l[2].name == "c" && l[2].table == "t" && l[2].column == "a" );
+        QVERIFY( !l[3].isDirect() && l[3].name == "d" );
+    }
+    {
+        // filtered
+        QScopedPointer<QgsSql::Node> n( QgsSql::parseSql( "select a from t where b = 'x'", err ) );
+        QVERIFY( QgsSql::columnLineage( *n, t ).isEmpty() );
+    }
+}
+
 QTEST_MAIN( TestSqlParser )
 #include "test_parser.moc"
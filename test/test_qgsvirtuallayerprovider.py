@@ -38,6 +38,7 @@ QGISAPP, CANVAS, IFACE, PARENT = getQgisTestApp()
 
 import os
 import tempfile
+import time
 
 class TestQgsVirtualLayerProvider(TestCase):
 
@@ -51,6 +52,14 @@ class TestQgsVirtualLayerProvider(TestCase):
         print "In method", self._testMethodName
         print "****************************************************"
 
+    def exactFeatureCount( self, provider ):
+        # wait for the count computed in the background, if any
+        if provider.featureCount() == -1:
+            loop = QEventLoop()
+            QObject.connect( provider, SIGNAL("statisticsReady()"), loop.quit )
+            loop.exec_()
+        return provider.featureCount()
+
     def test_CsvNoGeometry(self):
         l1 = QgsVectorLayer( os.path.join(self.testDataDir_, "test.csv") + "?type=csv&geomType=none&subsetIndex=no&watchFile=no", "test", "delimitedtext", False)
         self.assertEqual( l1.isValid(), True )
@@ -267,7 +276,9 @@ class TestQgsVirtualLayerProvider(TestCase):
         query = QUrl.toPercentEncoding("select * from vtab where _search_frame_=BuildMbr(-2.10,49.38,-1.3,49.99,4326)")
         l2 = QgsVectorLayer("?layer=ogr:%s:vtab&query=%s&uid=objectid" % (source,query), "vtab2", "virtual", False)
         self.assertEqual( l2.isValid(), True )
-        self.assertEqual(l2.dataProvider().featureCount(), 1)
+        # the query has to be evaluated, the count is not known yet
+        self.assertEqual(l2.dataProvider().featureCount(), -1)
+        self.assertEqual(self.exactFeatureCount(l2.dataProvider()), 1)
         a = [fit.attributes()[4] for fit in l2.getFeatures()]
         self.assertEqual(a, [u"Basse-Normandie"])
 
@@ -432,6 +443,9 @@ class TestQgsVirtualLayerProvider(TestCase):
         r = QgsFeatureRequest()
         r.setFilterFids( [ 2661, 2664 ] )
         self.assertEqual( sum(f.id() for f in l5.getFeatures(r)), 2661+2664)
+        # the id set of a previous request must not leak into the next one
+        r.setFilterFids( [ 2662 ] )
+        self.assertEqual( sum(f.id() for f in l5.getFeatures(r)), 2662)
 
         # test attribute subset
         r = QgsFeatureRequest()
@@ -575,5 +589,110 @@ class TestQgsVirtualLayerProvider(TestCase):
             self.assertEqual(f.geometry().exportToWkt().lower().startswith("multilinestring"), True)
             self.assertEqual("),(" in f.geometry().exportToWkt(), True) # has two linestrings
 
+    def test_constraint_pushdown( self ):
+        source = QUrl.toPercentEncoding(os.path.join(self.testDataDir_, "france_parts.shp"))
+        # constraints are passed to the provider as an expression, but results must be the same
+        for where, ids in [ ("OBJECTID > 2661 and NAME_1 like 'b%'", [2662]),
+                            ("OBJECTID >= 2662 and OBJECTID < 2672", [2662, 2664]),
+                            ("NAME_1 glob 'B*' and OBJECTID <> 2662", [2661]),
+                            ("NAME_1 = 'Centre'", [2672]),
+                            ("OBJECTID = '2661'", [2661]) ]:
+            query = QUrl.toPercentEncoding("select * from vtab where " + where)
+            l = QgsVectorLayer("?layer=ogr:%s:vtab&query=%s&uid=OBJECTID" % (source, query), "vtab2", "virtual", False)
+            self.assertEqual( l.isValid(), True )
+            self.assertEqual( sorted([f.id() for f in l.getFeatures()]), ids )
+
+    def test_attribute_join( self ):
+        source = QUrl.toPercentEncoding(os.path.join(self.testDataDir_, "france_parts.shp"))
+        # equality on attributes, resolved by hash indexes
+        query = QUrl.toPercentEncoding("select a.OBJECTID, b.OBJECTID from t1 as a, t2 as b where a.NAME_1 = b.NAME_1 and a.OBJECTID + 0.0 = b.OBJECTID")
+        l = QgsVectorLayer("?layer=ogr:%s:t1&layer=ogr:%s:t2&query=%s&nogeometry" % (source, source, query), "vtab2", "virtual", False)
+        self.assertEqual( l.isValid(), True )
+        self.assertEqual( sorted([f.attributes()[0] for f in l.getFeatures()]), [2661, 2662, 2664, 2672] )
+
+    def test_cache( self ):
+        source = QUrl.toPercentEncoding(os.path.join(self.testDataDir_, "france_parts.shp"))
+        # the same results are returned from the in-memory snapshot or with read-ahead
+        query = QUrl.toPercentEncoding("select a.OBJECTID, b.NAME_1, st_area(b.geometry) from t1 as a, t2 as b where intersects(a.geometry, b.geometry) and a.NAME_1 = b.NAME_1")
+        results = []
+        for cache in ["", "&cache=t1&cache=t2", "&prefetch=t1&prefetch=t2"]:
+            l = QgsVectorLayer("?layer=ogr:%s:t1&layer=ogr:%s:t2&query=%s&nogeometry%s" % (source, source, query, cache), "vtab2", "virtual", False)
+            self.assertEqual( l.isValid(), True )
+            results.append( sorted([f.attributes() for f in l.getFeatures()]) )
+        self.assertEqual( len(results[0]), 4 )
+        self.assertEqual( results[0], results[1] )
+        self.assertEqual( results[0], results[2] )
+
+    def test_min_max_unique( self ):
+        source = QUrl.toPercentEncoding(os.path.join(self.testDataDir_, "france_parts.shp"))
+        query = QUrl.toPercentEncoding("select OBJECTID as id, NAME_1 as name from vtab")
+        l = QgsVectorLayer("?layer=ogr:%s:vtab&query=%s&nogeometry" % (source, query), "vtab2", "virtual", False)
+        self.assertEqual( l.isValid(), True )
+        p = l.dataProvider()
+        self.assertEqual( p.minimumValue(0), 2661 )
+        self.assertEqual( p.maximumValue(0), 2672 )
+        self.assertEqual( p.minimumValue(1), "Basse-Normandie" )
+        self.assertEqual( len(p.uniqueValues(1, 2)), 2 )
+        self.assertEqual( sorted(p.uniqueValues(1)), ["Basse-Normandie", "Bretagne", "Centre", "Pays de la Loire"] )
+
+    def test_filter_expression( self ):
+        source = QUrl.toPercentEncoding(os.path.join(self.testDataDir_, "france_parts.shp"))
+        l = QgsVectorLayer("?layer=ogr:%s:vtab&uid=OBJECTID" % source, "vtab2", "virtual", False)
+        self.assertEqual( l.isValid(), True )
+        # compiled, partially compiled and not compiled expressions
+        for expr, ids in [ ("OBJECTID > 2661 and NAME_1 ilike 'b%'", [2662]),
+                           ("OBJECTID in (2661, 2664) or lower(NAME_1) = 'centre'", [2661, 2664, 2672]),
+                           ("OBJECTID >= 2662 and NAME_1 ~ '^[PC]'", [2664, 2672]),
+                           ("NAME_1 like 'B%'", [2661, 2662]),
+                           # string ordering and numeric strings are left to QGIS
+                           ("NAME_1 > 'C' and NAME_1 <> '10'", [2664, 2672]) ]:
+            r = QgsFeatureRequest().setFilterExpression( expr )
+            self.assertEqual( sorted([f.id() for f in l.getFeatures(r)]), ids )
+
+    def test_spatial_index( self ):
+        source = QUrl.toPercentEncoding(os.path.join(self.testDataDir_, "france_parts.shp"))
+        query = QUrl.toPercentEncoding("select OBJECTID as uid, NAME_1, geometry from vtab")
+        l1 = QgsVectorLayer("?layer=ogr:%s:vtab&query=%s&uid=uid" % (source, query), "vtab1", "virtual", False)
+        l2 = QgsVectorLayer("?layer=ogr:%s:vtab&query=%s&uid=uid&spatial_index" % (source, query), "vtab2", "virtual", False)
+        self.assertEqual( l1.isValid(), True )
+        self.assertEqual( l2.isValid(), True )
+        # the same features are returned before and after the index is built
+        for i in range(10):
+            for flags in [QgsFeatureRequest.NoFlags, QgsFeatureRequest.ExactIntersect]:
+                r = QgsFeatureRequest( QgsRectangle(-1.677,49.624, -0.816,49.086) ).setFlags( flags )
+                self.assertEqual( sorted([f.id() for f in l2.getFeatures(r)]), sorted([f.id() for f in l1.getFeatures(r)]) )
+            time.sleep(0.05)
+
+    def test_materialize( self ):
+        source = QUrl.toPercentEncoding(os.path.join(self.testDataDir_, "france_parts.shp"))
+        query = QUrl.toPercentEncoding("select OBJECTID as uid, NAME_1, buffer(geometry, 0.1) as geom from vtab")
+        tmp = os.path.join(tempfile.gettempdir(), "t.sqlite")
+        l1 = QgsVectorLayer("?layer=ogr:%s:vtab&query=%s&uid=uid&geometry=geom" % (source, query), "vtab1", "virtual", False)
+        l2 = QgsVectorLayer("%s?layer=ogr:%s:vtab&query=%s&uid=uid&geometry=geom&materialize=1" % (tmp, source, query), "vtab2", "virtual", False)
+        self.assertEqual( l1.isValid(), True )
+        self.assertEqual( l2.isValid(), True )
+        r = QgsFeatureRequest( QgsRectangle(-1.677,49.624, -0.816,49.086) )
+        ids = sorted([f.id() for f in l1.getFeatures(r)])
+        self.assertEqual( sorted([f.id() for f in l2.getFeatures(r)]), ids )
+        self.assertEqual( self.exactFeatureCount(l2.dataProvider()), 4 )
+
+        # the stored output is reused
+        l3 = QgsVectorLayer( tmp, "tt", "virtual", False )
+        self.assertEqual( l3.isValid(), True )
+        self.assertEqual( sorted([f.id() for f in l3.getFeatures(r)]), ids )
+
+    def test_column_projection( self ):
+        source = QUrl.toPercentEncoding(os.path.join(self.testDataDir_, "france_parts.shp"))
+        # only some attributes and no geometry are fetched from the provider
+        query = QUrl.toPercentEncoding("select NAME_1, count(*) as n from vtab where OBJECTID > 2661 group by NAME_1")
+        l = QgsVectorLayer("?layer=ogr:%s:vtab&query=%s&nogeometry" % (source, query), "vtab2", "virtual", False)
+        self.assertEqual( l.isValid(), True )
+        self.assertEqual( sorted([f.attributes()[0] for f in l.getFeatures()]), ["Bretagne", "Centre", "Pays de la Loire"] )
+
+        query = QUrl.toPercentEncoding("select OBJECTID, st_area(geometry) as a from vtab")
+        l = QgsVectorLayer("?layer=ogr:%s:vtab&query=%s&nogeometry" % (source, query), "vtab2", "virtual", False)
+        self.assertEqual( l.isValid(), True )
+        self.assertEqual( all([f.attributes()[1] > 0 for f in l.getFeatures()]), True )
+
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,615 @@
+/***************************************************************************
+             vlayer_cache.cpp : In-memory indexes of source layers
+begin                : Oct, 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <algorithm>
+#include <limits>
+#include <math.h>
+
+#include <QCoreApplication>
+#include <QThread>
+
+#include <qgsvectorlayer.h>
+#include <qgsvectordataprovider.h>
+#include <qgsgeometry.h>
+#include <qgsproviderregistry.h>
+
+#include <sqlite3.h>
+
+#include "vlayer_module.h"
+#include "vlayer_cache.h"
+
+VLayerSourceWatcher::VLayerSourceWatcher( QgsVectorDataProvider* provider, QgsVectorLayer* layer ) :
+    QObject(), changed_(0)
+{
+    connect( provider, SIGNAL(dataChanged()), this, SLOT(onChanged()), Qt::DirectConnection );
+    if ( layer ) {
+        // edits are only seen by the provider once committed
+        connect( layer, SIGNAL(editingStopped()), this, SLOT(onChanged()), Qt::DirectConnection );
+        connect( layer, SIGNAL(dataChanged()), this, SLOT(onChanged()), Qt::DirectConnection );
+    }
+}
+
+bool VLayerSourceWatcher::testAndResetChanged()
+{
+    return changed_.testAndSetOrdered( 1, 0 );
+}
+
+void VLayerSourceWatcher::onChanged()
+{
+    changed_.fetchAndStoreOrdered( 1 );
+}
+
+namespace {
+struct CenterXLess
+{
+    bool operator()( const VLayerRTree::Entry& a, const VLayerRTree::Entry& b ) const
+    {
+        return a.box.xmin + a.box.xmax < b.box.xmin + b.box.xmax;
+    }
+};
+struct CenterYLess
+{
+    bool operator()( const VLayerRTree::Entry& a, const VLayerRTree::Entry& b ) const
+    {
+        return a.box.ymin + a.box.ymax < b.box.ymin + b.box.ymax;
+    }
+};
+}
+
+void VLayerRTree::build( QVector<Entry>& entries )
+{
+    ids_.clear();
+    levels_.clear();
+    int n = entries.size();
+    if ( n == 0 ) {
+        return;
+    }
+
+    // Sort-Tile-Recursive: sort by x, cut in vertical slices, then sort each slice by y
+    int n_leaves = (n + NODE_CAPACITY - 1) / NODE_CAPACITY;
+    int n_slices = int( ceil( sqrt( double(n_leaves) ) ) );
+    int slice_size = n_slices * NODE_CAPACITY;
+    std::sort( entries.begin(), entries.end(), CenterXLess() );
+    for ( int i = 0; i < n; i += slice_size ) {
+        std::sort( entries.begin() + i, entries.begin() + qMin( i + slice_size, n ), CenterYLess() );
+    }
+
+    ids_.resize( n );
+    QVector<Box> leaves( n );
+    for ( int i = 0; i < n; i++ ) {
+        ids_[i] = entries[i].id;
+        leaves[i] = entries[i].box;
+    }
+    levels_ << leaves;
+
+    // upper levels, until a single root
+    while ( levels_.last().size() > 1 ) {
+        const QVector<Box>& children = levels_.last();
+        QVector<Box> parents( (children.size() + NODE_CAPACITY - 1) / NODE_CAPACITY );
+        for ( int p = 0; p < parents.size(); p++ ) {
+            Box b = children[p * NODE_CAPACITY];
+            int end = qMin( (p + 1) * NODE_CAPACITY, children.size() );
+            for ( int c = p * NODE_CAPACITY + 1; c < end; c++ ) {
+                b.xmin = qMin( b.xmin, children[c].xmin );
+                b.ymin = qMin( b.ymin, children[c].ymin );
+                b.xmax = qMax( b.xmax, children[c].xmax );
+                b.ymax = qMax( b.ymax, children[c].ymax );
+            }
+            parents[p] = b;
+        }
+        levels_ << parents;
+    }
+}
+
+void VLayerRTree::build( QgsVectorDataProvider* provider, QgsAbstractFeatureSource* source )
+{
+    QVector<Entry> entries;
+    if ( provider->featureCount() > 0 ) {
+        entries.reserve( provider->featureCount() );
+    }
+
+    // only geometries are needed
+    QgsFeatureRequest request;
+    request.setSubsetOfAttributes( QgsAttributeList() );
+    QgsFeatureIterator it = source->getFeatures( request );
+    QgsFeature f;
+    while ( it.nextFeature( f ) ) {
+        QgsGeometry* g = f.geometry();
+        if ( !g || !g->asWkb() ) {
+            continue;
+        }
+        QgsRectangle r = g->boundingBox();
+        Entry e;
+        e.id = f.id();
+        e.box.xmin = r.xMinimum();
+        e.box.ymin = r.yMinimum();
+        e.box.xmax = r.xMaximum();
+        e.box.ymax = r.yMaximum();
+        entries << e;
+    }
+    build( entries );
+}
+
+QgsFeatureIds VLayerRTree::intersects( const QgsRectangle& r ) const
+{
+    QgsFeatureIds result;
+    if ( levels_.isEmpty() ) {
+        return result;
+    }
+    Box b;
+    b.xmin = r.xMinimum();
+    b.ymin = r.yMinimum();
+    b.xmax = r.xMaximum();
+    b.ymax = r.yMaximum();
+    query_( levels_.size() - 1, 0, b, result );
+    return result;
+}
+
+void VLayerRTree::query_( int level, int node, const Box& b, QgsFeatureIds& result ) const
+{
+    const QVector<Box>& boxes = levels_[level];
+    if ( !boxes[node].intersects( b ) ) {
+        return;
+    }
+    if ( level == 0 ) {
+        result << ids_[node];
+        return;
+    }
+    int end = qMin( (node + 1) * NODE_CAPACITY, levels_[level - 1].size() );
+    for ( int c = node * NODE_CAPACITY; c < end; c++ ) {
+        query_( level - 1, c, b, result );
+    }
+}
+
+void VLayerHashIndex::build( QgsVectorDataProvider* provider, QgsAbstractFeatureSource* source, int field )
+{
+    ids_.clear();
+    QVariant::Type type = provider->fields().at( field ).type();
+
+    // only the indexed attribute is needed
+    QgsFeatureRequest request;
+    request.setSubsetOfAttributes( QgsAttributeList() << field );
+    request.setFlags( QgsFeatureRequest::NoGeometry );
+    QgsFeatureIterator it = source->getFeatures( request );
+    QgsFeature f;
+    while ( it.nextFeature( f ) ) {
+        QVariant v = f.attribute( field );
+        if ( v.isNull() ) {
+            continue;
+        }
+        QString key;
+        if ( type == QVariant::Double ) {
+            key = numberKey( v.toDouble() );
+        }
+        else if ( type == QVariant::String ) {
+            key = stringKey( v.toString() );
+        }
+        else {
+            key = numberKey( v.toLongLong() );
+        }
+        ids_[key] << f.id();
+    }
+}
+
+void VLayerHashIndex::build( const VLayerSnapshot& snapshot, int field )
+{
+    ids_.clear();
+    for ( int i = 0; i < snapshot.size(); i++ ) {
+        QString key = snapshot.hashKey( i, field );
+        if ( !key.isNull() ) {
+            ids_[key] << snapshot.id( i );
+        }
+    }
+}
+
+QgsFeatureIds VLayerHashIndex::lookup( const QString& key ) const
+{
+    QgsFeatureIds result;
+    QHash<QString, QVector<QgsFeatureId> >::const_iterator it = ids_.constFind( key );
+    if ( it != ids_.constEnd() ) {
+        result.reserve( it->size() );
+        foreach ( QgsFeatureId id, *it ) {
+            result << id;
+        }
+    }
+    return result;
+}
+
+QString VLayerHashIndex::numberKey( qint64 v )
+{
+    return "n:" + QString::number( v );
+}
+
+QString VLayerHashIndex::numberKey( double v )
+{
+    // 1.0 = 1 in SQLite
+    if ( v == floor( v ) && fabs( v ) < 9.2e18 ) {
+        return numberKey( qint64( v ) );
+    }
+    return "n:" + QString::number( v, 'g', 17 );
+}
+
+QString VLayerHashIndex::stringKey( const QString& v )
+{
+    return "s:" + v;
+}
+
+void VLayerSnapshot::build( QgsVectorDataProvider* provider, QgsAbstractFeatureSource* source, int32_t srid )
+{
+    const QgsFields& fields = provider->fields();
+    int n = provider->featureCount() > 0 ? provider->featureCount() : 0;
+
+    // same conversions as vtable_column
+    columns_.resize( fields.count() );
+    for ( int i = 0; i < fields.count(); i++ ) {
+        switch ( fields.at( i ).type() ) {
+        case QVariant::Int:
+        case QVariant::UInt:
+            columns_[i].kind = IntColumn;
+            columns_[i].ints.reserve( n );
+            break;
+        case QVariant::Double:
+            columns_[i].kind = DoubleColumn;
+            columns_[i].doubles.reserve( n );
+            break;
+        default:
+            columns_[i].kind = TextColumn;
+            columns_[i].text_offsets.reserve( n + 1 );
+            columns_[i].text_offsets << 0;
+            break;
+        }
+    }
+    ids_.reserve( n );
+    blob_offsets_.reserve( n + 1 );
+    blob_offsets_ << 0;
+    boxes_.reserve( n );
+
+    std::vector<unsigned char> blob;
+    QgsFeatureIterator it = source->getFeatures( QgsFeatureRequest() );
+    QgsFeature f;
+    while ( it.nextFeature( f ) ) {
+        int row = ids_.size();
+        ids_ << f.id();
+        rows_[f.id()] = row;
+
+        for ( int i = 0; i < columns_.size(); i++ ) {
+            Column& c = columns_[i];
+            QVariant v = f.attribute( i );
+            bool null = v.isNull();
+            if ( row >= c.nulls.size() ) {
+                c.nulls.resize( qMax( row + 1, 2 * c.nulls.size() ) );
+            }
+            c.nulls.setBit( row, null );
+            switch ( c.kind ) {
+            case IntColumn:
+                c.ints << ( null ? 0 : v.toLongLong() );
+                break;
+            case DoubleColumn:
+                c.doubles << ( null ? 0.0 : v.toDouble() );
+                break;
+            case TextColumn:
+                if ( !null ) {
+                    c.text.append( v.toString().toUtf8() );
+                }
+                c.text_offsets << c.text.size();
+                break;
+            }
+        }
+
+        VLayerRTree::Box b;
+        b.xmin = b.ymin = std::numeric_limits<double>::max();
+        b.xmax = b.ymax = -std::numeric_limits<double>::max();
+        QgsGeometry* g = f.geometry();
+        if ( g && qgsgeometry_to_spatialite_blob( *g, srid, blob ) ) {
+            blobs_.insert( blobs_.end(), blob.begin(), blob.end() );
+            QgsRectangle r = g->boundingBox();
+            b.xmin = r.xMinimum();
+            b.ymin = r.yMinimum();
+            b.xmax = r.xMaximum();
+            b.ymax = r.yMaximum();
+        }
+        blob_offsets_ << blobs_.size();
+        boxes_ << b;
+    }
+
+    for ( int i = 0; i < columns_.size(); i++ ) {
+        columns_[i].nulls.resize( ids_.size() );
+    }
+
+    memory_size_ = ids_.size() * (sizeof(QgsFeatureId) * 2 + sizeof(int) + sizeof(quint64) + sizeof(VLayerRTree::Box)) + blobs_.size();
+    for ( int i = 0; i < columns_.size(); i++ ) {
+        const Column& c = columns_[i];
+        memory_size_ += c.nulls.size() / 8 + c.ints.size() * sizeof(qint64) + c.doubles.size() * sizeof(double)
+            + c.text.size() + c.text_offsets.size() * sizeof(int);
+    }
+}
+
+void VLayerSnapshot::resultAttribute( sqlite3_context* ctxt, int row, int field ) const
+{
+    const Column& c = columns_[field];
+    if ( c.nulls.testBit( row ) ) {
+        sqlite3_result_null( ctxt );
+        return;
+    }
+    switch ( c.kind ) {
+    case IntColumn:
+        sqlite3_result_int64( ctxt, c.ints[row] );
+        break;
+    case DoubleColumn:
+        sqlite3_result_double( ctxt, c.doubles[row] );
+        break;
+    case TextColumn:
+        // transient: the snapshot may be evicted while SQLite still holds the value
+        sqlite3_result_text( ctxt, c.text.constData() + c.text_offsets[row], c.text_offsets[row + 1] - c.text_offsets[row], SQLITE_TRANSIENT );
+        break;
+    }
+}
+
+QString VLayerSnapshot::hashKey( int row, int field ) const
+{
+    // same keys as the ones of an index built from the provider
+    const Column& c = columns_[field];
+    if ( c.nulls.testBit( row ) ) {
+        return QString();
+    }
+    switch ( c.kind ) {
+    case IntColumn:
+        return VLayerHashIndex::numberKey( c.ints[row] );
+    case DoubleColumn:
+        return VLayerHashIndex::numberKey( c.doubles[row] );
+    case TextColumn:
+        return VLayerHashIndex::stringKey( QString::fromUtf8( c.text.constData() + c.text_offsets[row], c.text_offsets[row + 1] - c.text_offsets[row] ) );
+    }
+    return QString();
+}
+
+QPair<const unsigned char*, size_t> VLayerSnapshot::geometry( int row ) const
+{
+    size_t size = blob_offsets_[row + 1] - blob_offsets_[row];
+    if ( size == 0 ) {
+        return qMakePair( (const unsigned char*)0, (size_t)0 );
+    }
+    return qMakePair( (const unsigned char*)&blobs_[blob_offsets_[row]], size );
+}
+
+VLayerSnapshotCache* VLayerSnapshotCache::instance()
+{
+    static VLayerSnapshotCache cache;
+    return &cache;
+}
+
+void VLayerSnapshotCache::setBudget( size_t budget )
+{
+    QMutexLocker lock( &mutex_ );
+    budget_ = budget;
+    evict_( budget_ );
+}
+
+size_t VLayerSnapshotCache::budget() const
+{
+    QMutexLocker lock( &mutex_ );
+    return budget_;
+}
+
+QSharedPointer<const VLayerSnapshot> VLayerSnapshotCache::get( const QString& key )
+{
+    QMutexLocker lock( &mutex_ );
+    QHash<QString, Entry>::const_iterator it = entries_.constFind( key );
+    if ( it == entries_.constEnd() ) {
+        return QSharedPointer<const VLayerSnapshot>();
+    }
+    if ( it->watcher && it->watcher->testAndResetChanged() ) {
+        remove_( key );
+        return QSharedPointer<const VLayerSnapshot>();
+    }
+    lru_.removeOne( key );
+    lru_ << key;
+    return it->snapshot;
+}
+
+bool VLayerSnapshotCache::insert( const QString& key, QSharedPointer<const VLayerSnapshot> snapshot, QSharedPointer<VLayerSourceWatcher> watcher )
+{
+    QMutexLocker lock( &mutex_ );
+    remove_( key );
+    if ( snapshot->memorySize() > budget_ ) {
+        return false;
+    }
+    evict_( budget_ - snapshot->memorySize() );
+    Entry e;
+    e.snapshot = snapshot;
+    e.watcher = watcher;
+    entries_[key] = e;
+    lru_ << key;
+    size_ += snapshot->memorySize();
+    return true;
+}
+
+void VLayerSnapshotCache::remove( const QString& key )
+{
+    QMutexLocker lock( &mutex_ );
+    remove_( key );
+}
+
+void VLayerSnapshotCache::remove_( const QString& key )
+{
+    QHash<QString, Entry>::iterator it = entries_.find( key );
+    if ( it != entries_.end() ) {
+        size_ -= it->snapshot->memorySize();
+        entries_.erase( it );
+        lru_.removeOne( key );
+    }
+}
+
+void VLayerSnapshotCache::evict_( size_t budget )
+{
+    while ( size_ > budget && !lru_.isEmpty() ) {
+        QString key = lru_.first();
+        remove_( key );
+    }
+}
+
+VLayerProviderRegistry* VLayerProviderRegistry::instance()
+{
+    static VLayerProviderRegistry registry;
+    return &registry;
+}
+
+QgsVectorDataProvider* VLayerProviderRegistry::acquire( const QString& provider, const QString& source, const QString& encoding )
+{
+    QString key = provider + "\n" + encoding + "\n" + source;
+    {
+        QMutexLocker lock( &mutex_ );
+        QHash<QString, Entry>::iterator it = entries_.find( key );
+        if ( it != entries_.end() ) {
+            it->refs++;
+            return it->provider;
+        }
+    }
+
+    // the provider is created without the lock, so that different sources can be opened in parallel
+    QgsVectorDataProvider* p = static_cast<QgsVectorDataProvider*>( QgsProviderRegistry::instance()->provider( provider, source ) );
+    if ( p == 0 || !p->isValid() ) {
+        delete p;
+        return 0;
+    }
+    if ( p->capabilities() & QgsVectorDataProvider::SelectEncoding ) {
+        p->setEncoding( encoding );
+    }
+
+    QMutexLocker lock( &mutex_ );
+    QHash<QString, Entry>::iterator it = entries_.find( key );
+    if ( it != entries_.end() ) {
+        // the same source has been opened meanwhile
+        delete p;
+        it->refs++;
+        return it->provider;
+    }
+    // signals of the provider are delivered to the main thread, whatever the thread that opened it
+    if ( QCoreApplication::instance() && p->thread() != QCoreApplication::instance()->thread() ) {
+        p->moveToThread( QCoreApplication::instance()->thread() );
+    }
+    Entry e;
+    e.provider = p;
+    e.refs = 1;
+    e.statistics = QSharedPointer<Statistics>( new Statistics );
+    entries_[key] = e;
+    keys_[p] = key;
+    return p;
+}
+
+void VLayerProviderRegistry::release( QgsVectorDataProvider* provider )
+{
+    QMutexLocker lock( &mutex_ );
+    QHash<QgsVectorDataProvider*, QString>::iterator kit = keys_.find( provider );
+    if ( kit == keys_.end() ) {
+        return;
+    }
+    QHash<QString, Entry>::iterator it = entries_.find( *kit );
+    if ( --it->refs == 0 ) {
+        entries_.erase( it );
+        keys_.erase( kit );
+        // the provider lives in the main thread, it is deleted there
+        if ( QCoreApplication::instance() && provider->thread() != QThread::currentThread() ) {
+            provider->deleteLater();
+        }
+        else {
+            delete provider;
+        }
+    }
+}
+
+bool VLayerProviderRegistry::statistics( QgsVectorDataProvider* provider, long& feature_count, QgsRectangle& extent )
+{
+    QSharedPointer<Statistics> s;
+    {
+        QMutexLocker lock( &mutex_ );
+        Entry* e = entry_( provider );
+        if ( !e ) {
+            return false;
+        }
+        s = e->statistics;
+    }
+
+    // computed under the lock of the provider only, so that different sources are scanned in parallel
+    // and the provider is not queried from several threads at once
+    QMutexLocker lock( &s->mutex );
+    if ( !s->computed ) {
+        s->feature_count = provider->featureCount();
+        s->extent = provider->extent();
+        s->computed = true;
+    }
+    feature_count = s->feature_count;
+    extent = s->extent;
+    return true;
+}
+
+VLayerProviderRegistry::Entry* VLayerProviderRegistry::entry_( QgsVectorDataProvider* provider )
+{
+    QHash<QgsVectorDataProvider*, QString>::iterator kit = keys_.find( provider );
+    if ( kit == keys_.end() ) {
+        return 0;
+    }
+    return &entries_[*kit];
+}
+
+QSharedPointer<VLayerRTree> VLayerProviderRegistry::spatial_index( QgsVectorDataProvider* provider )
+{
+    QMutexLocker lock( &mutex_ );
+    Entry* e = entry_( provider );
+    return e ? e->rtree : QSharedPointer<VLayerRTree>();
+}
+
+void VLayerProviderRegistry::set_spatial_index( QgsVectorDataProvider* provider, QSharedPointer<VLayerRTree> index )
+{
+    QMutexLocker lock( &mutex_ );
+    Entry* e = entry_( provider );
+    if ( e ) {
+        e->rtree = index;
+    }
+}
+
+QSharedPointer<VLayerHashIndex> VLayerProviderRegistry::hash_index( QgsVectorDataProvider* provider, int field )
+{
+    QMutexLocker lock( &mutex_ );
+    Entry* e = entry_( provider );
+    return e ? e->hash_indexes.value( field ) : QSharedPointer<VLayerHashIndex>();
+}
+
+void VLayerProviderRegistry::set_hash_index( QgsVectorDataProvider* provider, int field, QSharedPointer<VLayerHashIndex> index )
+{
+    QMutexLocker lock( &mutex_ );
+    Entry* e = entry_( provider );
+    if ( e ) {
+        e->hash_indexes[field] = index;
+    }
+}
+
+void VLayerProviderRegistry::invalidate( QgsVectorDataProvider* provider )
+{
+    QSharedPointer<Statistics> s;
+    {
+        QMutexLocker lock( &mutex_ );
+        Entry* e = entry_( provider );
+        if ( !e ) {
+            return;
+        }
+        e->rtree.clear();
+        e->hash_indexes.clear();
+        s = e->statistics;
+    }
+    QMutexLocker lock( &s->mutex );
+    s->computed = false;
+}
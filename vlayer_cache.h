@@ -0,0 +1,320 @@
+/***************************************************************************
+             vlayer_cache.h : In-memory indexes of source layers
+begin                : Oct, 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef QGSVIRTUAL_LAYER_CACHE_H
+#define QGSVIRTUAL_LAYER_CACHE_H
+
+#include <QObject>
+#include <QVector>
+#include <QHash>
+#include <QBitArray>
+#include <QByteArray>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QAtomicInt>
+
+#include <vector>
+#include <stdint.h>
+
+#include <qgsfeature.h>
+#include <qgsrectangle.h>
+
+class QgsVectorLayer;
+class QgsVectorDataProvider;
+class QgsAbstractFeatureSource;
+struct sqlite3_context;
+class VLayerSnapshot;
+
+/**
+ * Watch a source layer for changes
+ *
+ * Connections are direct, so that the flag is set even if the watcher lives
+ * in a thread without event loop.
+ */
+class VLayerSourceWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    VLayerSourceWatcher( QgsVectorDataProvider* provider, QgsVectorLayer* layer = 0 );
+
+    //! Returns true if the source changed since the last call
+    bool testAndResetChanged();
+
+private slots:
+    void onChanged();
+
+private:
+    QAtomicInt changed_;
+};
+
+/**
+ * Static R-tree of feature ids, bulk loaded with the Sort-Tile-Recursive algorithm
+ *
+ * Nodes are packed level by level in flat arrays: the children of node i are
+ * the nodes [i*NODE_CAPACITY, (i+1)*NODE_CAPACITY) of the level below.
+ */
+class VLayerRTree
+{
+public:
+    static const int NODE_CAPACITY = 16;
+
+    struct Box
+    {
+        double xmin, ymin, xmax, ymax;
+
+        bool intersects( const Box& o ) const
+        {
+            return xmin <= o.xmax && o.xmin <= xmax && ymin <= o.ymax && o.ymin <= ymax;
+        }
+    };
+
+    struct Entry
+    {
+        QgsFeatureId id;
+        Box box;
+    };
+
+    VLayerRTree() {}
+
+    //! Build the tree, replacing any previous content
+    void build( QVector<Entry>& entries );
+
+    //! Build the tree from the features of a provider, read through its feature source
+    void build( QgsVectorDataProvider* provider, QgsAbstractFeatureSource* source );
+
+    //! Ids of features whose bounding box intersects the rectangle
+    QgsFeatureIds intersects( const QgsRectangle& r ) const;
+
+    int size() const { return ids_.size(); }
+
+private:
+    // leaves ids, in tree order
+    QVector<QgsFeatureId> ids_;
+    // boxes of each level, levels_[0] being the leaves
+    QVector<QVector<Box> > levels_;
+
+    void query_( int level, int node, const Box& b, QgsFeatureIds& result ) const;
+};
+
+/**
+ * Hash index of feature ids on the values of an attribute
+ *
+ * Values are indexed by a key that follows SQLite's comparison rules:
+ * integers and integral reals share the same key, strings are compared byte-wise.
+ * NULL values are not indexed.
+ */
+class VLayerHashIndex
+{
+public:
+    VLayerHashIndex() {}
+
+    //! Build the index on the given field of a provider, read through its feature source
+    void build( QgsVectorDataProvider* provider, QgsAbstractFeatureSource* source, int field );
+
+    //! Build the index on the given field from the rows of a snapshot
+    void build( const VLayerSnapshot& snapshot, int field );
+
+    //! Ids of features with the given key
+    QgsFeatureIds lookup( const QString& key ) const;
+
+    //! Number of distinct keys
+    int size() const { return ids_.size(); }
+
+    //! Key of a number
+    static QString numberKey( qint64 v );
+    static QString numberKey( double v );
+    //! Key of a string
+    static QString stringKey( const QString& v );
+
+private:
+    QHash<QString, QVector<QgsFeatureId> > ids_;
+};
+
+/**
+ * Columnar copy of the features of a source
+ *
+ * Attributes are stored in typed arrays, geometries as spatialite blobs
+ * along with their bounding boxes. A snapshot is immutable once built,
+ * so that it can be shared between connections.
+ */
+class VLayerSnapshot
+{
+public:
+    VLayerSnapshot() : memory_size_(0) {}
+
+    //! Read all the features of a provider through its feature source
+    void build( QgsVectorDataProvider* provider, QgsAbstractFeatureSource* source, int32_t srid );
+
+    //! Number of rows
+    int size() const { return ids_.size(); }
+
+    //! Approximate memory footprint, in bytes
+    size_t memorySize() const { return memory_size_; }
+
+    QgsFeatureId id( int row ) const { return ids_[row]; }
+
+    //! Row of a feature id, -1 if not found
+    int row( QgsFeatureId id ) const { return rows_.value( id, -1 ); }
+
+    //! Set the attribute of a row as the result of a SQLite function
+    void resultAttribute( sqlite3_context* ctxt, int row, int field ) const;
+
+    //! Key of the attribute of a row in a VLayerHashIndex, null for NULL values
+    QString hashKey( int row, int field ) const;
+
+    //! Geometry blob of a row, null pointer for NULL geometries
+    QPair<const unsigned char*, size_t> geometry( int row ) const;
+
+    //! Bounding box of the geometry of a row, empty for NULL geometries
+    const VLayerRTree::Box& box( int row ) const { return boxes_[row]; }
+
+private:
+    enum ColumnKind { IntColumn, DoubleColumn, TextColumn };
+    struct Column
+    {
+        ColumnKind kind;
+        QBitArray nulls;
+        QVector<qint64> ints;
+        QVector<double> doubles;
+        // UTF-8 strings, one after the other
+        QByteArray text;
+        QVector<int> text_offsets;
+    };
+
+    QVector<QgsFeatureId> ids_;
+    QHash<QgsFeatureId, int> rows_;
+    QVector<Column> columns_;
+
+    // geometry blobs, one after the other
+    std::vector<unsigned char> blobs_;
+    QVector<quint64> blob_offsets_;
+    QVector<VLayerRTree::Box> boxes_;
+
+    size_t memory_size_;
+};
+
+/**
+ * Process-wide cache of snapshots, under a memory budget
+ *
+ * Snapshots are indexed by a key identifying their source and are evicted
+ * in least recently used order. Users hold a shared pointer while reading
+ * a snapshot, so that an eviction does not free it under their feet.
+ */
+class VLayerSnapshotCache
+{
+public:
+    //! Default memory budget, in bytes
+    static const size_t DEFAULT_BUDGET = 256 * 1024 * 1024;
+
+    static VLayerSnapshotCache* instance();
+
+    void setBudget( size_t budget );
+    size_t budget() const;
+
+    //! Snapshot of a source, null if not cached or if the source changed
+    QSharedPointer<const VLayerSnapshot> get( const QString& key );
+
+    //! Add a snapshot, evicting older ones if needed
+    //! The optional watcher is kept with the snapshot, to invalidate it when the source changes.
+    //! Returns false if the snapshot alone does not fit in the budget
+    bool insert( const QString& key, QSharedPointer<const VLayerSnapshot> snapshot, QSharedPointer<VLayerSourceWatcher> watcher = QSharedPointer<VLayerSourceWatcher>() );
+
+    void remove( const QString& key );
+
+private:
+    VLayerSnapshotCache() : budget_(DEFAULT_BUDGET), size_(0) {}
+
+    struct Entry
+    {
+        QSharedPointer<const VLayerSnapshot> snapshot;
+        QSharedPointer<VLayerSourceWatcher> watcher;
+    };
+
+    void remove_( const QString& key );
+    void evict_( size_t budget );
+
+    mutable QMutex mutex_;
+    size_t budget_;
+    size_t size_;
+    // most recently used last
+    QList<QString> lru_;
+    QHash<QString, Entry> entries_;
+};
+
+/**
+ * Process-wide registry of source providers
+ *
+ * Virtual tables over the same (provider key, source, encoding) share one provider,
+ * which is deleted when its last user releases it.
+ * Features must be read through featureSource() snapshots, since users may live in different threads.
+ */
+class VLayerProviderRegistry
+{
+public:
+    static VLayerProviderRegistry* instance();
+
+    //! Get a provider, creating it if needed. Returns null if the provider is invalid
+    //! Can be called from any thread, different sources are then opened in parallel
+    QgsVectorDataProvider* acquire( const QString& provider, const QString& source, const QString& encoding );
+
+    //! Release a provider returned by acquire()
+    void release( QgsVectorDataProvider* provider );
+
+    //! Feature count and extent of a provider returned by acquire(), computed once for all its users
+    //! Returns false if the provider has not been returned by acquire()
+    bool statistics( QgsVectorDataProvider* provider, long& feature_count, QgsRectangle& extent );
+
+    //! In-memory indexes of a provider returned by acquire(), shared by all its users
+    //! Null if not built yet
+    QSharedPointer<VLayerRTree> spatial_index( QgsVectorDataProvider* provider );
+    void set_spatial_index( QgsVectorDataProvider* provider, QSharedPointer<VLayerRTree> index );
+    QSharedPointer<VLayerHashIndex> hash_index( QgsVectorDataProvider* provider, int field );
+    void set_hash_index( QgsVectorDataProvider* provider, int field, QSharedPointer<VLayerHashIndex> index );
+
+    //! Statistics and indexes of the provider will be computed again, after a change of its source
+    void invalidate( QgsVectorDataProvider* provider );
+
+private:
+    VLayerProviderRegistry() {}
+
+    // statistics of a provider, computed by its first user while the next ones wait
+    struct Statistics
+    {
+        Statistics() : computed(false), feature_count(-1) {}
+        QMutex mutex;
+        bool computed;
+        long feature_count;
+        QgsRectangle extent;
+    };
+
+    struct Entry
+    {
+        QgsVectorDataProvider* provider;
+        int refs;
+        QSharedPointer<Statistics> statistics;
+        QSharedPointer<VLayerRTree> rtree;
+        QHash<int, QSharedPointer<VLayerHashIndex> > hash_indexes;
+    };
+
+    // entry of a provider, null if not returned by acquire()
+    Entry* entry_( QgsVectorDataProvider* provider );
+
+    QMutex mutex_;
+    QHash<QString, Entry> entries_;
+    QHash<QgsVectorDataProvider*, QString> keys_;
+};
+
+#endif
@@ -18,20 +18,32 @@ email                : hugo dot mercier at oslandia dot com
 #include <string.h>
 #include <iostream>
 #include <stdint.h>
+#include <math.h>
+#include <limits>
+#include <vector>
 
 #include <QCoreApplication>
+#include <QFileInfo>
+#include <QMap>
+#include <QRegExp>
+#include <QSharedPointer>
 
 #include <qgsapplication.h>
 #include <qgsvectorlayer.h>
 #include <qgsvectordataprovider.h>
 #include <qgsgeometry.h>
+#include <qgsexpression.h>
 #include <qgsmaplayerregistry.h>
 #include <qgsproviderregistry.h>
 
 #include <sqlite3.h>
 #include <spatialite.h>
+#include <spatialite/gaiageo.h>
 #include <stdio.h>
 #include "vlayer_module.h"
+#include "vlayer_cache.h"
+#include "vlayer_prefetch.h"
+#include "qgsvirtuallayercache.h"
 
 /**
  * Structure created in SQLITE module creation and passed to xCreate/xConnect
@@ -122,7 +134,139 @@ QString geometry_type_string( QGis::WkbType type )
     return "";
 }
 
-void qgsgeometry_to_spatialite_blob( const QgsGeometry& geom, int32_t srid, unsigned char *&blob, size_t& size )
+namespace {
+// bounding box accumulated while copying coordinates
+struct _blob_mbr {
+    double min_x, min_y, max_x, max_y;
+    _blob_mbr() : min_x(std::numeric_limits<double>::max()), min_y(std::numeric_limits<double>::max()),
+                  max_x(-std::numeric_limits<double>::max()), max_y(-std::numeric_limits<double>::max()) {}
+    bool isNull() const { return min_x > max_x; }
+};
+}
+
+// convert a QGIS WKB type (25D flags or ISO codes) to a spatialite type and get its number of dimensions
+static uint32_t wkb_type_to_spatialite( uint32_t type, int& n_dims )
+{
+    bool has_z, has_m;
+    uint32_t base;
+    if ( type & 0xC0000000 ) {
+        // 25D (Z) and M flags
+        has_z = (type & 0x80000000) != 0;
+        has_m = (type & 0x40000000) != 0;
+        base = type & 0x0FFFFFFF;
+    }
+    else {
+        // ISO codes: 1000 for Z, 2000 for M, 3000 for ZM
+        has_z = (type / 1000) & 1;
+        has_m = ((type / 1000) & 2) != 0;
+        base = type % 1000;
+    }
+    n_dims = 2 + (has_z ? 1 : 0) + (has_m ? 1 : 0);
+    return base + (has_z ? 1000 : 0) + (has_m ? 2000 : 0);
+}
+
+// copy n_points coordinates and update the bounding box in the same pass
+static inline bool copy_wkb_points( const unsigned char*& iwkb, const unsigned char* iend, unsigned char*& owkb, uint32_t n_points, int n_dims, _blob_mbr& mbr )
+{
+    size_t len = size_t(n_points) * n_dims * sizeof(double);
+    if ( size_t(iend - iwkb) < len ) {
+        return false;
+    }
+    memcpy( owkb, iwkb, len );
+    const unsigned char* pt = owkb;
+    for ( uint32_t i = 0; i < n_points; i++, pt += n_dims * sizeof(double) ) {
+        double x, y;
+        memcpy( &x, pt, sizeof(double) );
+        memcpy( &y, pt + sizeof(double), sizeof(double) );
+        if ( x < mbr.min_x ) mbr.min_x = x;
+        if ( x > mbr.max_x ) mbr.max_x = x;
+        if ( y < mbr.min_y ) mbr.min_y = y;
+        if ( y > mbr.max_y ) mbr.max_y = y;
+    }
+    iwkb += len;
+    owkb += len;
+    return true;
+}
+
+static inline bool copy_wkb_uint32( const unsigned char*& iwkb, const unsigned char* iend, unsigned char*& owkb, uint32_t& v )
+{
+    if ( iend - iwkb < 4 ) {
+        return false;
+    }
+    memcpy( &v, iwkb, 4 );
+    memcpy( owkb, iwkb, 4 );
+    iwkb += 4;
+    owkb += 4;
+    return true;
+}
+
+// copy a WKB geometry (type included, endianness byte excluded) to a spatialite geometry
+static bool copy_wkb_to_spatialite( const unsigned char*& iwkb, const unsigned char* iend, unsigned char*& owkb, _blob_mbr& mbr )
+{
+    uint32_t type;
+    if ( iend - iwkb < 4 ) {
+        return false;
+    }
+    memcpy( &type, iwkb, 4 );
+    iwkb += 4;
+    int n_dims;
+    uint32_t stype = wkb_type_to_spatialite( type, n_dims );
+    memcpy( owkb, &stype, 4 );
+    owkb += 4;
+
+    uint32_t n;
+    switch ( stype % 1000 ) {
+    case 1:
+        // point
+        return copy_wkb_points( iwkb, iend, owkb, 1, n_dims, mbr );
+    case 2:
+        // linestring
+        return copy_wkb_uint32( iwkb, iend, owkb, n ) && copy_wkb_points( iwkb, iend, owkb, n, n_dims, mbr );
+    case 3: {
+        // polygon
+        if ( !copy_wkb_uint32( iwkb, iend, owkb, n ) ) {
+            return false;
+        }
+        for ( uint32_t i = 0; i < n; i++ ) {
+            uint32_t n_points;
+            if ( !copy_wkb_uint32( iwkb, iend, owkb, n_points ) || !copy_wkb_points( iwkb, iend, owkb, n_points, n_dims, mbr ) ) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case 4:
+    case 5:
+    case 6:
+    case 7: {
+        // collections: each element is an entity starting with a marker instead of the endianness
+        if ( !copy_wkb_uint32( iwkb, iend, owkb, n ) ) {
+            return false;
+        }
+        for ( uint32_t i = 0; i < n; i++ ) {
+            if ( iwkb >= iend ) {
+                return false;
+            }
+            iwkb++;
+            *owkb++ = 0x69;
+            if ( !copy_wkb_to_spatialite( iwkb, iend, owkb, mbr ) ) {
+                return false;
+            }
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+/**
+ * Encode a geometry as a spatialite blob
+ *
+ * The blob buffer is reused from one call to another and only grows.
+ * The MBR of the header is computed while copying the coordinates.
+ * Returns false if the geometry cannot be encoded.
+ */
+bool qgsgeometry_to_spatialite_blob( const QgsGeometry& geom, int32_t srid, std::vector<unsigned char>& blob )
 {
     // BLOB header
     // name    size    value
@@ -135,7 +279,7 @@ void qgsgeometry_to_spatialite_blob( const QgsGeometry& geom, int32_t srid, unsi
     // mbr_max_y 8      double
     // mbr_end   1      7C
     //          4*8+4+3=4
-    size_t header_len = 39;
+    const size_t header_len = 39;
 
     // wkb of the geometry is
     // name         size    value
@@ -144,56 +288,39 @@ void qgsgeometry_to_spatialite_blob( const QgsGeometry& geom, int32_t srid, unsi
 
     // blob geometry = header + wkb[1:] + 'end'
 
+    const unsigned char* wkb = geom.asWkb();
     size_t wkb_size = geom.wkbSize();
-    size = header_len + wkb_size;
-    blob = new unsigned char[size];
-
-    QgsRectangle bbox = const_cast<QgsGeometry&>(geom).boundingBox();
-    double mbr_min_x, mbr_min_y, mbr_max_x, mbr_max_y;
-    mbr_min_x = bbox.xMinimum();
-    mbr_max_x = bbox.xMaximum();
-    mbr_min_y = bbox.yMinimum();
-    mbr_max_y = bbox.yMaximum();
+    if ( !wkb || wkb_size < 5 ) {
+        return false;
+    }
+    blob.resize( header_len + wkb_size );
 
-    unsigned char* p = blob;
+    unsigned char* p = &blob[0];
     *p = 0x00; p++; // start
     *p = 0x01; p++; // endianness
     memcpy( p, &srid, sizeof(srid) ); p+= sizeof(srid);
-    memcpy( p, &mbr_min_x, sizeof(double) ); p+= sizeof(double);
-    memcpy( p, &mbr_min_y, sizeof(double) ); p+= sizeof(double);
-    memcpy( p, &mbr_max_x, sizeof(double) ); p+= sizeof(double);
-    memcpy( p, &mbr_max_y, sizeof(double) ); p+= sizeof(double);
+    unsigned char* mbr_p = p;
+    p += 4 * sizeof(double);
     *p = 0x7C; p++; // mbr_end
 
-    // copy wkb
-    memcpy( p, geom.asWkb() + 1, wkb_size - 1 );
-    uint32_t type = *(uint32_t*)p;
-    uint32_t type2 = type & 0x3FFFFFFF;
-    if ( type & 0x80000000 ) {
-        // Z flag
-        type2 += 1000;
-    }
-    else if ( type & 0x40000000 ) {
-        // M flag
-        type2 += 2000;
+    // copy wkb, without its endianness byte
+    _blob_mbr mbr;
+    const unsigned char* iwkb = wkb + 1;
+    if ( !copy_wkb_to_spatialite( iwkb, wkb + wkb_size, p, mbr ) ) {
+        return false;
     }
-    memcpy( p, &type2, 4 );
-    p += wkb_size - 1;
     // end marker
     *p = 0xFE;
-}
 
-namespace {
-struct _blob_header {
-    unsigned char start;
-    unsigned char endianness;
-    uint32_t srid;
-    double mbr_min_x;
-    double mbr_min_y;
-    double mbr_max_x;
-    double mbr_max_y;
-    unsigned char end;
-};
+    if ( mbr.isNull() ) {
+        // empty geometry
+        mbr.min_x = mbr.min_y = mbr.max_x = mbr.max_y = 0.0;
+    }
+    memcpy( mbr_p, &mbr.min_x, sizeof(double) ); mbr_p += sizeof(double);
+    memcpy( mbr_p, &mbr.min_y, sizeof(double) ); mbr_p += sizeof(double);
+    memcpy( mbr_p, &mbr.max_x, sizeof(double) ); mbr_p += sizeof(double);
+    memcpy( mbr_p, &mbr.max_y, sizeof(double) );
+    return true;
 }
 
 QgsRectangle spatialite_blob_bbox( const unsigned char* blob, const size_t size )
@@ -206,111 +333,237 @@ QgsRectangle spatialite_blob_bbox( const unsigned char* blob, const size_t size
     // mbr_min_y 8      double
     // mbr_max_x 8      double
     // mbr_max_y 8      double
+    // mbr_end   1      7C
 
-    _blob_header h;
-    memcpy( &h, blob, sizeof(h) );
+    // the header is enough for little endian blobs, compressed or not
+    if ( blob && size >= 39 + 5 && blob[0] == 0x00 && blob[1] == 0x01 && blob[38] == 0x7C && blob[size-1] == 0xFE ) {
+        // the MBR is not aligned in the blob, copy it out
+        double mbr[4];
+        memcpy( mbr, blob + 6, 4 * sizeof(double) );
+        return QgsRectangle( mbr[0], mbr[1], mbr[2], mbr[3] );
+    }
 
-    return QgsRectangle( h.mbr_min_x, h.mbr_min_y, h.mbr_max_x, h.mbr_max_y );
+    // otherwise, let spatialite parse the whole geometry
+    QgsRectangle r;
+    gaiaGeomCollPtr g = blob ? gaiaFromSpatiaLiteBlobWkb( blob, size ) : 0;
+    if ( g ) {
+        gaiaMbrGeometry( g );
+        r = QgsRectangle( g->MinX, g->MinY, g->MaxX, g->MaxY );
+        gaiaFreeGeomColl( g );
+    }
+    return r;
 }
 
-void copy_spatialite_single_wkb_to_qgsgeometry( uint32_t type, const unsigned char* iwkb, unsigned char* owkb, uint32_t& osize )
+namespace {
+/**
+ * Conversion of spatialite geometries to QGIS WKB, specialized for each set of dimensions
+ *
+ * Both formats share the same coordinate layout, so coordinates are copied by whole runs
+ * (a ring, a linestring) with a single memcpy, which is vectorized by the C library.
+ */
+template <bool HAS_Z, bool HAS_M>
+struct SpatialiteWkbDecoder
 {
-  int dims = type / 1000;
-  int n_dims = 2 + (dims&1) + (dims&2);
-  switch (type%1000)
-  {
-  case 1:
-    // point
-    memcpy( owkb, iwkb, n_dims*8 );
-    iwkb += n_dims*8;
-    iwkb += n_dims*8;
-    osize = n_dims*8;
-    break;
-  case 2: {
-    // linestring
-    uint32_t n_points = *(uint32_t*)iwkb;
-    memcpy( owkb, iwkb, 4 );
-    iwkb+=4; owkb+=4;
-    for ( uint32_t i = 0; i < n_points; i++ ) {
-      memcpy( owkb, iwkb, n_dims*8 );
-      iwkb += n_dims*8;
-      owkb += n_dims*8;
-    }
-    osize += n_dims*8*n_points + 4;
-    break;
-  }
-  case 3: {
-    // polygon
-    uint32_t n_rings = *(uint32_t*)iwkb;
-    memcpy( owkb, iwkb, 4 );
-    iwkb+=4; owkb+=4;
-    osize = 4;
-    for ( uint32_t i = 0; i < n_rings; i++ ) {
-      uint32_t n_points = *(uint32_t*)iwkb;
-      memcpy( owkb, iwkb, 4 );
-      iwkb+=4; owkb+=4;
-      osize += 4;
-      for ( uint32_t j = 0; j < n_points; j++ ) {
-        memcpy( owkb, iwkb, n_dims*8 );
-        iwkb += n_dims*8;
-        owkb += n_dims*8;
-        osize += n_dims*8;
-      }
-    }
-    break;
-  }
-  }
-}
-
-void copy_spatialite_collection_wkb_to_qgsgeometry( const unsigned char* iwkb, unsigned char* owkb, uint32_t& osize )
-{
-  memcpy( owkb, iwkb, 5 );
-  owkb[0] = 0x01; // endianness
-  size_t copy_size = 0;
-  uint32_t type = *(uint32_t*)(iwkb+1);
-
-  // convert type
-  uint32_t type2 = (type > 1000) ? (type%1000 + 0x80000000) : type;
-  *(uint32_t*)(owkb+1) = type2;
-
-  if ( (type % 1000) >= 4 ) {
-    // multi type
-    uint32_t n_elements = *(uint32_t*)(iwkb+5);
-    memcpy( owkb+5, iwkb+5, 4 );
-    uint32_t p = 0;
-    for ( uint32_t i = 0; i < n_elements; i++ ) {
-      uint32_t rsize = 0;
-      copy_spatialite_collection_wkb_to_qgsgeometry( iwkb+9+p, owkb+9+p, rsize );
-      p += rsize;
-    }
-    osize = p+9;
-  }
-  else {
-    osize = 0;
-    copy_spatialite_single_wkb_to_qgsgeometry( type, iwkb+5, owkb+5, osize );
-    osize += 5;
-  }
+    static const size_t POINT_SIZE = (2 + (HAS_Z ? 1 : 0) + (HAS_M ? 1 : 0)) * sizeof(double);
+
+    static uint32_t qgisType( uint32_t base )
+    {
+        if ( HAS_Z && !HAS_M ) {
+            // 25D flag, understood by every QGIS version
+            return base | 0x80000000;
+        }
+        return base + (HAS_Z ? 1000 : 0) + (HAS_M ? 2000 : 0);
+    }
+
+    static inline bool copyPoints( const unsigned char*& iwkb, const unsigned char* iend, unsigned char*& owkb, uint32_t n_points )
+    {
+        size_t len = n_points * POINT_SIZE;
+        if ( size_t(iend - iwkb) < len ) {
+            return false;
+        }
+        memcpy( owkb, iwkb, len );
+        iwkb += len;
+        owkb += len;
+        return true;
+    }
+
+    static inline bool copyCount( const unsigned char*& iwkb, const unsigned char* iend, unsigned char*& owkb, uint32_t& n )
+    {
+        if ( iend - iwkb < 4 ) {
+            return false;
+        }
+        memcpy( &n, iwkb, 4 );
+        memcpy( owkb, iwkb, 4 );
+        iwkb += 4;
+        owkb += 4;
+        return true;
+    }
+
+    // copy a geometry, once its marker and type have been read
+    static bool copy( uint32_t base, const unsigned char*& iwkb, const unsigned char* iend, unsigned char*& owkb );
+};
+
+bool copy_spatialite_entity( const unsigned char*& iwkb, const unsigned char* iend, unsigned char*& owkb );
+
+template <bool HAS_Z, bool HAS_M>
+bool SpatialiteWkbDecoder<HAS_Z, HAS_M>::copy( uint32_t base, const unsigned char*& iwkb, const unsigned char* iend, unsigned char*& owkb )
+{
+    uint32_t type = qgisType( base );
+    memcpy( owkb, &type, 4 );
+    owkb += 4;
+
+    uint32_t n;
+    switch ( base ) {
+    case 1:
+        // point
+        return copyPoints( iwkb, iend, owkb, 1 );
+    case 2:
+        // linestring
+        return copyCount( iwkb, iend, owkb, n ) && copyPoints( iwkb, iend, owkb, n );
+    case 3:
+        // polygon
+        if ( !copyCount( iwkb, iend, owkb, n ) ) {
+            return false;
+        }
+        for ( uint32_t i = 0; i < n; i++ ) {
+            uint32_t n_points;
+            if ( !copyCount( iwkb, iend, owkb, n_points ) || !copyPoints( iwkb, iend, owkb, n_points ) ) {
+                return false;
+            }
+        }
+        return true;
+    case 4:
+    case 5:
+    case 6:
+    case 7:
+        // multi types and collections
+        if ( !copyCount( iwkb, iend, owkb, n ) ) {
+            return false;
+        }
+        for ( uint32_t i = 0; i < n; i++ ) {
+            if ( !copy_spatialite_entity( iwkb, iend, owkb ) ) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+// copy a spatialite geometry starting with its marker (0x7C or 0x69) to a QGIS WKB
+bool copy_spatialite_entity( const unsigned char*& iwkb, const unsigned char* iend, unsigned char*& owkb )
+{
+    if ( iend - iwkb < 5 ) {
+        return false;
+    }
+    uint32_t type;
+    memcpy( &type, iwkb + 1, 4 );
+    iwkb += 5;
+    *owkb = 0x01; // endianness
+    owkb++;
+
+    switch ( type / 1000 ) {
+    case 0:
+        return SpatialiteWkbDecoder<false, false>::copy( type % 1000, iwkb, iend, owkb );
+    case 1:
+        return SpatialiteWkbDecoder<true, false>::copy( type % 1000, iwkb, iend, owkb );
+    case 2:
+        return SpatialiteWkbDecoder<false, true>::copy( type % 1000, iwkb, iend, owkb );
+    case 3:
+        return SpatialiteWkbDecoder<true, true>::copy( type % 1000, iwkb, iend, owkb );
+    }
+    // compressed geometries
+    return false;
+}
+}
+
+// conversion through the spatialite library, for big endian and compressed geometries
+static std::unique_ptr<QgsGeometry> spatialite_blob_to_qgsgeometry_slow( const unsigned char* blob, const size_t size )
+{
+    std::unique_ptr<QgsGeometry> geom( new QgsGeometry() );
+    gaiaGeomCollPtr g = gaiaFromSpatiaLiteBlobWkb( blob, size );
+    if ( !g ) {
+        return geom;
+    }
+    unsigned char* wkb = 0;
+    int wkb_size = 0;
+    gaiaToWkb( g, &wkb, &wkb_size );
+    gaiaFreeGeomColl( g );
+    if ( wkb ) {
+        unsigned char* owkb = new unsigned char[wkb_size];
+        memcpy( owkb, wkb, wkb_size );
+        free( wkb );
+        geom->fromWkb( owkb, wkb_size );
+    }
+    return geom;
 }
 
 std::unique_ptr<QgsGeometry> spatialite_blob_to_qgsgeometry( const unsigned char* blob, const size_t size )
 {
-    size_t header_size = 39;
+    const size_t header_size = 39;
+    if ( size < header_size + 5 || blob[0] != 0x00 || blob[1] != 0x01 || blob[header_size-1] != 0x7C || blob[size-1] != 0xFE ) {
+        return spatialite_blob_to_qgsgeometry_slow( blob, size );
+    }
+
+    // the QGIS WKB has exactly the size of the blob without its header and end marker
+    // the buffer is allocated once and owned by the geometry
     size_t wkb_size = size - header_size;
     unsigned char* wkb = new unsigned char[wkb_size];
 
-    uint32_t osize = 0;
-    copy_spatialite_collection_wkb_to_qgsgeometry( blob + header_size - 1, wkb, osize );
+    const unsigned char* iwkb = blob + header_size - 1;
+    unsigned char* owkb = wkb;
+    if ( !copy_spatialite_entity( iwkb, blob + size - 1, owkb ) ) {
+        delete[] wkb;
+        return spatialite_blob_to_qgsgeometry_slow( blob, size );
+    }
 
     std::unique_ptr<QgsGeometry> geom(new QgsGeometry());
     geom->fromWkb( wkb, wkb_size );
     return geom;
 }
 
-void delete_geometry_blob( void * p )
+// whether the provider filters rectangles with an index of its own
+// known from the provider key and source, before the source is opened
+static bool provider_has_spatial_index( const QString& name, const QString& source )
+{
+    if ( name == "postgres" || name == "spatialite" || name == "mssql" || name == "oracle" || name == "virtual" || name == "WFS" ) {
+        // databases and remote services
+        return true;
+    }
+    if ( name == "ogr" ) {
+        QFileInfo fi( source.split( '|' )[0] );
+        QString ext = fi.suffix().toLower();
+        if ( ext == "shp" ) {
+            // shapefiles are only indexed with a .qix file
+            return QFileInfo( fi.path() + "/" + fi.completeBaseName() + ".qix" ).exists();
+        }
+        return ext == "gpkg" || ext == "sqlite";
+    }
+    // memory, delimitedtext, gpx, ...
+    return false;
+}
+
+// whether a provider evaluates attribute filters with indexes of its own
+static bool provider_has_attribute_index( const QString& name )
 {
-    delete[] (unsigned char*)p;
+    return name == "postgres" || name == "spatialite" || name == "mssql" || name == "oracle" || name == "virtual";
 }
 
+/**
+ * Schema of a table over an embedded layer, persisted in _columns when the table is created,
+ * so that it can be declared again without opening its source
+ */
+struct VTableSchema
+{
+    QgsFields fields;
+    QGis::WkbType geometry_type;
+    long srid;
+    int pk_column;
+    // statistics of the source when the table was created
+    long feature_count;
+    QgsRectangle extent;
+};
+
 struct VTable
 {
     // minimal set of members (see sqlite3.h)
@@ -318,32 +571,86 @@ struct VTable
     int nRef;                       /* NO LONGER USED */
     char *zErrMsg;                  /* Error message from sqlite3_mprintf() */
 
-    VTable( sqlite3* db, QgsVectorLayer* layer ) : sql_(db), provider_(layer->dataProvider()), pk_column_(-1), zErrMsg(0), owned_(false), name_(layer->name())
+    VTable( sqlite3* db, QgsVectorLayer* layer ) : sql_(db), provider_(layer->dataProvider()), layer_(layer), pk_column_(-1), zErrMsg(0), owned_(false), name_(layer->name()), stats_cached_(false), cache_enabled_(false), prefetch_enabled_(false)
     {
-        init_();
+        cache_key_ = "layer:" + layer->id();
+        stamp_files_( layer->providerType(), layer->source() );
+        init_( layer );
     }
 
     VTable( sqlite3* db, const QString& provider, const QString& source, const QString& name, const QString& encoding )
-        : sql_(db), pk_column_(-1), zErrMsg(0), name_(name), encoding_(encoding)
+        : sql_(db), layer_(0), pk_column_(-1), zErrMsg(0), name_(name), provider_key_(provider), source_(source), encoding_(encoding), stats_cached_(false), cache_enabled_(false), prefetch_enabled_(false)
     {
-        provider_ = static_cast<QgsVectorDataProvider*>(QgsProviderRegistry::instance()->provider( provider, source ));
-        if ( provider_ == 0 || !provider_->isValid() ) {
+        cache_key_ = provider + ":" + encoding + ":" + source;
+        // shared with other tables over the same source
+        provider_ = VLayerProviderRegistry::instance()->acquire( provider, source, encoding );
+        if ( provider_ == 0 ) {
             throw std::runtime_error( "Invalid provider" );
         }
-        if ( provider_->capabilities() & QgsVectorDataProvider::SelectEncoding ) {
-            provider_->setEncoding( encoding_ );
-        }
         owned_ = true;
-        init_();
+        stamp_files_( provider, source );
+        init_( 0 );
+    }
+
+    // table over an embedded layer, declared from its persisted schema
+    // the source is opened by open(), when the table is read
+    VTable( sqlite3* db, const QString& provider, const QString& source, const QString& name, const QString& encoding, const VTableSchema& schema )
+        : sql_(db), provider_(0), layer_(0), owned_(false), pk_column_(schema.pk_column), zErrMsg(0), name_(name), provider_key_(provider), source_(source), encoding_(encoding), stats_cached_(true), cache_enabled_(false), prefetch_enabled_(false)
+    {
+        cache_key_ = provider + ":" + encoding + ":" + source;
+        fields_ = schema.fields;
+        geometry_type_ = schema.geometry_type;
+        feature_count_ = schema.feature_count;
+        extent_ = schema.extent;
+        has_native_spatial_index_ = provider_has_spatial_index( provider, source );
+        has_native_attribute_index_ = provider_has_attribute_index( provider );
+        crs_ = schema.srid;
+        stamp_files_( provider, source );
+        declare_();
     }
 
     ~VTable()
     {
         if (owned_ && provider_ ) {
-            delete provider_;
+            VLayerProviderRegistry::instance()->release( provider_ );
         }
     }
 
+    // open the source of a table declared from its persisted schema, if not already done
+    // returns false and sets the error message of the table if it cannot be opened
+    bool open()
+    {
+        if ( provider_ ) {
+            return true;
+        }
+        provider_ = VLayerProviderRegistry::instance()->acquire( provider_key_, source_, encoding_ );
+        if ( provider_ == 0 ) {
+            set_error_( "Invalid provider" );
+            return false;
+        }
+        owned_ = true;
+
+        // the source may have changed since the table was created
+        const QgsFields& fields = provider_->fields();
+        bool same = fields.count() == fields_.count() && provider_->geometryType() == geometry_type_;
+        for ( int i = 0; same && i < fields.count(); i++ ) {
+            same = fields.at(i).name() == fields_.at(i).name();
+        }
+        if ( !same ) {
+            VLayerProviderRegistry::instance()->release( provider_ );
+            provider_ = 0;
+            owned_ = false;
+            set_error_( QString( "The structure of %1 has changed since the table %2 was created" ).arg( source_ ).arg( name_ ) );
+            return false;
+        }
+
+        // reference system and indexes of the source itself
+        watch_( 0 );
+        // statistics of the source itself from now on
+        stats_cached_ = false;
+        return true;
+    }
+
     QgsVectorDataProvider* provider()
     {
         return provider_;
@@ -351,6 +658,9 @@ struct VTable
 
     QString name() const { return name_; }
 
+    // attributes of the table, available before the source is opened
+    const QgsFields& fields() const { return fields_; }
+
     QString creation_string() const { return creation_str_; }
 
     long crs() const { return crs_; }
@@ -359,6 +669,175 @@ struct VTable
 
     int pk_column() const { return pk_column_; }
 
+    // number of features of the source, cached for the cost model (-1 if unknown)
+    long feature_count()
+    {
+        if ( !stats_cached_ ) {
+            update_statistics_();
+        }
+        return feature_count_;
+    }
+
+    // extent of the source, cached for the cost model
+    QgsRectangle extent()
+    {
+        if ( !stats_cached_ ) {
+            update_statistics_();
+        }
+        return extent_;
+    }
+
+    // drop cached statistics and indexes if the source has changed
+    void check_source_changed()
+    {
+        // a source not opened yet has not been read
+        bool changed = watcher_ && watcher_->testAndResetChanged();
+        // files edited through another provider in this session are only seen by their stamp
+        QString stamp = file_stamp_.stamp();
+        if ( stamp != file_stamp_value_ ) {
+            file_stamp_value_ = stamp;
+            changed = true;
+        }
+        if ( changed ) {
+            // the persisted statistics of a source not opened yet are kept until open()
+            stats_cached_ = provider_ == 0;
+            if ( owned_ ) {
+                VLayerProviderRegistry::instance()->invalidate( provider_ );
+            }
+            rtree_.clear();
+            hash_indexes_.clear();
+            feature_source_.clear();
+            if ( cache_enabled_ ) {
+                VLayerSnapshotCache::instance()->remove( cache_key_ );
+            }
+        }
+    }
+
+    // serve scans from an in-memory snapshot of the source
+    void set_cache_enabled( bool enabled ) { cache_enabled_ = enabled; }
+
+    // read features ahead in a worker thread
+    void set_prefetch_enabled( bool enabled ) { prefetch_enabled_ = enabled; }
+    bool prefetch_enabled() const { return prefetch_enabled_; }
+
+    // feature source of the provider, that can be used from another thread
+    // features are always read through it, since the provider may be shared
+    QSharedPointer<QgsAbstractFeatureSource> feature_source()
+    {
+        if ( !feature_source_ ) {
+            feature_source_ = QSharedPointer<QgsAbstractFeatureSource>( provider_->featureSource() );
+        }
+        return feature_source_;
+    }
+
+    // feature source of the provider, not shared with other cursors
+    QSharedPointer<QgsAbstractFeatureSource> new_feature_source()
+    {
+        return QSharedPointer<QgsAbstractFeatureSource>( provider_->featureSource() );
+    }
+
+    // snapshot of the source, built on first use
+    // null if the cache is not enabled
+    QSharedPointer<const VLayerSnapshot> snapshot()
+    {
+        if ( !cache_enabled_ ) {
+            return QSharedPointer<const VLayerSnapshot>();
+        }
+        QSharedPointer<const VLayerSnapshot> s = VLayerSnapshotCache::instance()->get( cache_key_ );
+        if ( !s ) {
+            QSharedPointer<VLayerSnapshot> ns( new VLayerSnapshot );
+            ns->build( provider_, feature_source().data(), crs_ );
+            // the snapshot outlives this table, watch the layer for changes
+            QSharedPointer<VLayerSourceWatcher> watcher;
+            if ( layer_ ) {
+                watcher = QSharedPointer<VLayerSourceWatcher>( new VLayerSourceWatcher( provider_, layer_ ) );
+            }
+            if ( !VLayerSnapshotCache::instance()->insert( cache_key_, ns, watcher ) ) {
+                // too big for the cache, do not try again
+                cache_enabled_ = false;
+            }
+            s = ns;
+        }
+        return s;
+    }
+
+    // whether an in-memory hash index may be used for equality constraints on a field
+    bool can_hash_index( int field ) const
+    {
+        if ( has_native_attribute_index_ ) {
+            return false;
+        }
+        QVariant::Type t = fields_.at( field ).type();
+        return t == QVariant::Int || t == QVariant::UInt || t == QVariant::Double || t == QVariant::String;
+    }
+
+    // in-memory hash index of a field, built on first use if build is true
+    // from the rows of the snapshot if one is given
+    // indexes of a shared provider are shared with the tables of other connections
+    const VLayerHashIndex* hash_index( int field, bool build = true, const VLayerSnapshot* snapshot = 0 )
+    {
+        QSharedPointer<VLayerHashIndex> index = hash_indexes_.value( field );
+        if ( !index && owned_ ) {
+            index = VLayerProviderRegistry::instance()->hash_index( provider_, field );
+            if ( index ) {
+                hash_indexes_[field] = index;
+            }
+        }
+        if ( !index && build ) {
+            index = QSharedPointer<VLayerHashIndex>( new VLayerHashIndex );
+            if ( snapshot ) {
+                index->build( *snapshot, field );
+            }
+            else {
+                index->build( provider_, feature_source().data(), field );
+            }
+            hash_indexes_[field] = index;
+            if ( owned_ ) {
+                VLayerProviderRegistry::instance()->set_hash_index( provider_, field, index );
+            }
+        }
+        return index.data();
+    }
+
+    // number of lookups on a field, the last one included
+    int count_hash_lookup( int field ) { return ++hash_lookups_[field]; }
+
+    // in-memory spatial index, built on first use
+    // null if the provider has its own spatial index and no snapshot is given
+    const VLayerRTree* spatial_index( const VLayerSnapshot* snapshot = 0 )
+    {
+        if ( !rtree_ && owned_ ) {
+            rtree_ = VLayerProviderRegistry::instance()->spatial_index( provider_ );
+        }
+        if ( !rtree_ ) {
+            if ( snapshot ) {
+                QVector<VLayerRTree::Entry> entries;
+                entries.reserve( snapshot->size() );
+                for ( int i = 0; i < snapshot->size(); i++ ) {
+                    if ( snapshot->geometry( i ).first ) {
+                        VLayerRTree::Entry e;
+                        e.id = snapshot->id( i );
+                        e.box = snapshot->box( i );
+                        entries << e;
+                    }
+                }
+                rtree_ = QSharedPointer<VLayerRTree>( new VLayerRTree );
+                rtree_->build( entries );
+            }
+            else if ( has_native_spatial_index_ ) {
+                return 0;
+            }
+            else {
+                rtree_ = QSharedPointer<VLayerRTree>( new VLayerRTree );
+                rtree_->build( provider_, feature_source().data() );
+            }
+            if ( owned_ ) {
+                VLayerProviderRegistry::instance()->set_spatial_index( provider_, rtree_ );
+            }
+        }
+        return rtree_.data();
+    }
+
 private:
     // connection
     sqlite3* sql_;
@@ -366,13 +845,21 @@ private:
     // specific members
     // pointer to the underlying vector provider
     QgsVectorDataProvider* provider_;
-    // whether the underlying provider is owned or not
+    // source layer, null if the provider comes from the registry
+    QgsVectorLayer* layer_;
+    // whether the underlying provider comes from the provider registry
     bool owned_;
 
     QString name_;
 
+    // provider key and source of an embedded layer
+    QString provider_key_;
+    QString source_;
     QString encoding_;
 
+    QgsFields fields_;
+    QGis::WkbType geometry_type_;
+
     // primary key column (default = -1: none)
     int pk_column_;
 
@@ -381,18 +868,74 @@ private:
 
     long crs_;
 
-    void init_()
+    // statistics of the source
+    bool stats_cached_;
+    long feature_count_;
+    QgsRectangle extent_;
+
+    // change signals of the source
+    QScopedPointer<VLayerSourceWatcher> watcher_;
+    // modification times and sizes of the files of the source
+    QgsVirtualLayerSourceStamp file_stamp_;
+    QString file_stamp_value_;
+
+    bool has_native_spatial_index_;
+    QSharedPointer<VLayerRTree> rtree_;
+
+    bool has_native_attribute_index_;
+    // field index => hash index
+    QHash<int, QSharedPointer<VLayerHashIndex> > hash_indexes_;
+    QHash<int, int> hash_lookups_;
+
+    bool cache_enabled_;
+    // identifies the source in the snapshot cache
+    QString cache_key_;
+
+    bool prefetch_enabled_;
+    // snapshot of the provider, shared by cursors
+    QSharedPointer<QgsAbstractFeatureSource> feature_source_;
+
+    void update_statistics_()
+    {
+        // a shared provider is queried once for all the tables over it
+        if ( !owned_ || !VLayerProviderRegistry::instance()->statistics( provider_, feature_count_, extent_ ) ) {
+            feature_count_ = provider_->featureCount();
+            extent_ = provider_->extent();
+        }
+        stats_cached_ = true;
+    }
+
+    void init_( QgsVectorLayer* layer )
+    {
+        fields_ = provider_->fields();
+        geometry_type_ = provider_->geometryType();
+        if ( provider_->pkAttributeIndexes().size() == 1 ) {
+            pk_column_ = provider_->pkAttributeIndexes()[0] + 1;
+        }
+        watch_( layer );
+        declare_();
+    }
+
+    // state depending on the opened provider
+    void watch_( QgsVectorLayer* layer )
     {
         // FIXME : connect to layer deletion signal
-        const QgsFields& fields = provider_->fields();
+        watcher_.reset( new VLayerSourceWatcher( provider_, layer ) );
+        has_native_spatial_index_ = provider_has_spatial_index( provider_->name(), provider_->dataSourceUri() );
+        has_native_attribute_index_ = provider_has_attribute_index( provider_->name() );
+        crs_ = provider_->crs().postgisSrid();
+    }
+
+    void declare_()
+    {
         QStringList sql_fields;
 
         // add a hidden field for rtree filtering
         sql_fields << "_search_frame_ HIDDEN BLOB";
 
-        for ( int i = 0; i < fields.count(); i++ ) {
+        for ( int i = 0; i < fields_.count(); i++ ) {
             QString typeName = "TEXT";
-            switch (fields.at(i).type()) {
+            switch (fields_.at(i).type()) {
             case QVariant::Int:
             case QVariant::UInt:
             case QVariant::Bool:
@@ -406,20 +949,26 @@ private:
                 typeName = "TEXT";
                 break;
             }
-            sql_fields << fields.at(i).name() + " " + typeName;
-        }
-
-        if ( provider_->geometryType() != QGis::WKBNoGeometry ) {
-            sql_fields << "geometry " + geometry_type_string(provider_->geometryType());
+            sql_fields << fields_.at(i).name() + " " + typeName;
         }
 
-        if ( provider_->pkAttributeIndexes().size() == 1 ) {
-            pk_column_ = provider_->pkAttributeIndexes()[0] + 1;
+        if ( geometry_type_ != QGis::WKBNoGeometry ) {
+            sql_fields << "geometry " + geometry_type_string(geometry_type_);
         }
 
         creation_str_ = "CREATE TABLE vtable (" + sql_fields.join(",") + ")";
+    }
 
-        crs_ = provider_->crs().postgisSrid();
+    void stamp_files_( const QString& provider, const QString& source )
+    {
+        file_stamp_.addSource( provider, source );
+        file_stamp_value_ = file_stamp_.stamp();
+    }
+
+    void set_error_( const QString& msg )
+    {
+        sqlite3_free( zErrMsg );
+        zErrMsg = sqlite3_mprintf( "%s", msg.toUtf8().constData() );
     }
 };
 
@@ -433,40 +982,108 @@ struct VTableCursor
     QgsFeatureIterator iterator_;
     bool eof_;
 
-    VTableCursor( VTable *vtab ) : vtab_(vtab), eof_(true) {}
+    VTableCursor( VTable *vtab ) : vtab_(vtab), eof_(true), all_rows_(false), pos_(0) {}
 
     void filter( QgsFeatureRequest request )
     {
-        iterator_ = vtab_->provider()->getFeatures( request );
+        snapshot_.clear();
+        prefetcher_.reset();
+        // only full scans are read ahead in a worker thread: filtered requests are the
+        // probes of joins, repeated for each outer row, where a thread would cost more than it saves
+        if ( vtab_->prefetch_enabled() && request.filterType() == QgsFeatureRequest::FilterNone ) {
+            iterator_ = QgsFeatureIterator();
+            // feature sources must not be shared between threads, the worker gets its own
+            prefetcher_.reset( new VLayerPrefetcher( vtab_->new_feature_source(), request ) );
+            prefetcher_->start();
+        }
+        else {
+            iterator_ = vtab_->feature_source()->getFeatures( request );
+        }
         // get on the first record
         eof_ = false;
         next();
     }
 
+    // empty result, without querying the provider
+    void filter_nothing()
+    {
+        snapshot_.clear();
+        prefetcher_.reset();
+        iterator_ = QgsFeatureIterator();
+        eof_ = true;
+    }
+
+    // serve rows of a snapshot: the given rows, or all of them if all_rows is true
+    void filter_snapshot( QSharedPointer<const VLayerSnapshot> snapshot, const QVector<int>& rows, bool all_rows )
+    {
+        iterator_ = QgsFeatureIterator();
+        prefetcher_.reset();
+        snapshot_ = snapshot;
+        rows_ = rows;
+        all_rows_ = all_rows;
+        pos_ = 0;
+        eof_ = (all_rows_ ? snapshot_->size() : rows_.size()) == 0;
+    }
+
     void next()
     {
-        if ( !eof_ ) {
+        if ( eof_ ) {
+            return;
+        }
+        if ( snapshot_ ) {
+            pos_++;
+            eof_ = pos_ >= (all_rows_ ? snapshot_->size() : rows_.size());
+        }
+        else if ( prefetcher_ ) {
+            eof_ = !prefetcher_->nextFeature( current_feature_ );
+        }
+        else {
             eof_ = !iterator_.nextFeature( current_feature_ );
         }
     }
 
     bool eof() const { return eof_; }
 
-    int n_columns() const { return vtab_->provider()->fields().count(); }
+    int n_columns() const { return vtab_->fields().count(); }
+
+    // snapshot the cursor reads from, if any
+    const VLayerSnapshot* snapshot() const { return snapshot_.data(); }
 
-    sqlite3_int64 current_id() const { return current_feature_.id(); }
+    // current row of the snapshot
+    int current_row() const { return all_rows_ ? pos_ : rows_[pos_]; }
+
+    sqlite3_int64 current_id() const { return snapshot_ ? snapshot_->id( current_row() ) : current_feature_.id(); }
 
     QVariant current_attribute( int column ) const { return current_feature_.attribute(column); }
 
-    QPair<unsigned char*, size_t> current_geometry() const
+    // encode the current geometry in the cursor's buffer
+    // the returned pointer is valid until the next call
+    QPair<const unsigned char*, size_t> current_geometry()
     {
-        size_t blob_len;
-        unsigned char* blob;
+        if ( snapshot_ ) {
+            return snapshot_->geometry( current_row() );
+        }
         // make it work for pre 2.10 and 2.10 qgis version
-        QgsGeometry* g = const_cast<QgsFeature&>(current_feature_).geometry();
-        qgsgeometry_to_spatialite_blob( *g, vtab_->crs(), blob, blob_len );
-        return qMakePair( blob, blob_len );
+        QgsGeometry* g = current_feature_.geometry();
+        if ( !g || !qgsgeometry_to_spatialite_blob( *g, vtab_->crs(), blob_buffer_ ) ) {
+            // no geometry fetched, or NULL geometry
+            return qMakePair( (const unsigned char*)0, (size_t)0 );
+        }
+        return qMakePair( (const unsigned char*)&blob_buffer_[0], blob_buffer_.size() );
     }
+
+private:
+    // reusable buffer for geometry blobs
+    std::vector<unsigned char> blob_buffer_;
+
+    // snapshot mode
+    QSharedPointer<const VLayerSnapshot> snapshot_;
+    QVector<int> rows_;
+    bool all_rows_;
+    int pos_;
+
+    // prefetch mode
+    QScopedPointer<VLayerPrefetcher> prefetcher_;
 };
 
 void get_geometry_type( const QgsVectorDataProvider* provider, QString& geometry_type_str, int& geometry_dim, int& geometry_wkb_type, long& srid )
@@ -541,11 +1158,113 @@ void get_geometry_type( const QgsVectorDataProvider* provider, QString& geometry
     }
 }
 
+// QGIS type of a spatialite geometry type, as written by get_geometry_type
+static QGis::WkbType wkb_type_from_spatialite( int type )
+{
+    switch ( type ) {
+    case 1:
+        return QGis::WKBPoint;
+    case 1001:
+        return QGis::WKBPoint25D;
+    case 4:
+        return QGis::WKBMultiPoint;
+    case 1004:
+        return QGis::WKBMultiPoint25D;
+    case 2:
+        return QGis::WKBLineString;
+    case 1002:
+        return QGis::WKBLineString25D;
+    case 5:
+        return QGis::WKBMultiLineString;
+    case 1005:
+        return QGis::WKBMultiLineString25D;
+    case 3:
+        return QGis::WKBPolygon;
+    case 1003:
+        return QGis::WKBPolygon25D;
+    case 6:
+        return QGis::WKBMultiPolygon;
+    case 1006:
+        return QGis::WKBMultiPolygon25D;
+    }
+    return QGis::WKBNoGeometry;
+}
+
+// read the schema persisted by the creation of a table
+// returns false if the table has been created by a version that did not persist it
+static bool read_vtable_schema( sqlite3* sql, const QString& table, VTableSchema& schema )
+{
+    schema.fields.clear();
+    schema.geometry_type = QGis::WKBNoGeometry;
+    schema.srid = -1;
+    schema.pk_column = -1;
+    schema.feature_count = -1;
+    schema.extent = QgsRectangle();
+
+    sqlite3_stmt* stmt;
+    int r = sqlite3_prepare_v2( sql, "SELECT c.name, c.type FROM _columns c, _tables t WHERE c.table_id = t.id AND t.name = ? ORDER BY c.rowid", -1, &stmt, NULL );
+    if (r) {
+        throw std::runtime_error( sqlite3_errmsg( sql ) );
+    }
+    QByteArray tba( table.toUtf8() );
+    sqlite3_bind_text( stmt, 1, tba.constData(), tba.size(), SQLITE_TRANSIENT );
+    bool persisted = false;
+    while ( sqlite3_step( stmt ) == SQLITE_ROW ) {
+        QString name = QString::fromUtf8( (const char*)sqlite3_column_text( stmt, 0 ) );
+        QString type = QString::fromUtf8( (const char*)sqlite3_column_text( stmt, 1 ) );
+        if ( name == "*geometry*" ) {
+            // wkb_type:dim:srid
+            QStringList l = type.split( ':' );
+            if ( l.size() == 3 ) {
+                schema.geometry_type = wkb_type_from_spatialite( l[0].toInt() );
+                schema.srid = l[2].toLong();
+            }
+        }
+        else if ( name == "*pk*" ) {
+            schema.pk_column = type.toInt();
+            persisted = true;
+        }
+        else if ( name == "*count*" ) {
+            schema.feature_count = type.toLong();
+        }
+        else {
+            schema.fields.append( QgsField( name, QVariant::nameToType( type.toUtf8().constData() ) ) );
+        }
+    }
+    sqlite3_finalize( stmt );
+
+    if ( persisted && schema.geometry_type != QGis::WKBNoGeometry ) {
+        r = sqlite3_prepare_v2( sql, "SELECT extent_min_x, extent_min_y, extent_max_x, extent_max_y FROM virts_geometry_columns_statistics WHERE virt_name = ?", -1, &stmt, NULL );
+        if (r) {
+            throw std::runtime_error( sqlite3_errmsg( sql ) );
+        }
+        QByteArray vba( table.toLower().toUtf8() );
+        sqlite3_bind_text( stmt, 1, vba.constData(), vba.size(), SQLITE_TRANSIENT );
+        if ( sqlite3_step( stmt ) == SQLITE_ROW ) {
+            schema.extent = QgsRectangle( sqlite3_column_double( stmt, 0 ), sqlite3_column_double( stmt, 1 ),
+                                          sqlite3_column_double( stmt, 2 ), sqlite3_column_double( stmt, 3 ) );
+        }
+        sqlite3_finalize( stmt );
+    }
+    return persisted;
+}
+
 int vtable_create_connect( sqlite3* sql, void* aux, int argc, const char* const* argv, sqlite3_vtab **out_vtab, char** out_err, bool is_created )
 {
 #define RETURN_CSTR_ERROR(err) if (out_err) {size_t s = strlen(err); *out_err=(char*)sqlite3_malloc(s+1); strncpy(*out_err, err, s);}
 #define RETURN_CPPSTR_ERROR(err) if (out_err) {*out_err=(char*)sqlite3_malloc(err.size()+1); strncpy(*out_err, err.c_str(), err.size());}
 
+    // trailing key=value arguments are options
+    QMap<QString, QString> options;
+    while ( argc > 4 ) {
+        QRegExp reOption( "^(\\w+)=(\\w*)$" );
+        if ( !reOption.exactMatch( QString( argv[argc-1] ).trimmed() ) ) {
+            break;
+        }
+        options[reOption.cap(1).toLower()] = reOption.cap(2);
+        argc--;
+    }
+
     if ( argc < 4 ) {
         std::string err( "Missing arguments: layer_id | provider, source" );
         RETURN_CPPSTR_ERROR(err);
@@ -557,7 +1276,7 @@ int vtable_create_connect( sqlite3* sql, void* aux, int argc, const char* const*
     sqlite3_stmt *table_creation_stmt = 0;
     int r;
     if ( argc == 4 ) {
-        // CREATE VIRTUAL TABLE vtab USING QgsVLayer(layer_id)
+        // CREATE VIRTUAL TABLE vtab USING QgsVLayer(layer_id[,options])
         // vtab = argv[2]
         // layer_id = argv[3]
         QString layerid( argv[3] );
@@ -586,7 +1305,7 @@ int vtable_create_connect( sqlite3* sql, void* aux, int argc, const char* const*
         }
     }
     else if ( argc == 5 || argc == 6 ) {
-        // CREATE VIRTUAL TABLE vtab USING QgsVLayer(provider,source[,encoding])
+        // CREATE VIRTUAL TABLE vtab USING QgsVLayer(provider,source[,encoding][,options])
         // vtab = argv[2]
         // provider = argv[3]
         // source = argv[4]
@@ -606,7 +1325,14 @@ int vtable_create_connect( sqlite3* sql, void* aux, int argc, const char* const*
           source = source.mid(1, source.size()-2).replace( "''", "'" );
         }
         try {
-            new_vtab.reset(new VTable( sql, provider, source, argv[2], encoding ));
+            VTableSchema schema;
+            if ( !is_created && read_vtable_schema( sql, vname, schema ) ) {
+                // reconnection, the source is only opened if the table is read
+                new_vtab.reset(new VTable( sql, provider, source, argv[2], encoding, schema ));
+            }
+            else {
+                new_vtab.reset(new VTable( sql, provider, source, argv[2], encoding ));
+            }
         }
         catch (std::runtime_error& e) {
             std::string err(e.what());
@@ -630,6 +1356,11 @@ int vtable_create_connect( sqlite3* sql, void* aux, int argc, const char* const*
         }
     }
 
+    // cache=1: serve scans from an in-memory snapshot
+    new_vtab->set_cache_enabled( options.value( "cache" ) == "1" );
+    // prefetch=1: read features ahead in a worker thread
+    new_vtab->set_prefetch_enabled( options.value( "prefetch" ) == "1" );
+
     r = sqlite3_declare_vtab( sql, new_vtab->creation_string().toUtf8().constData() );
     if (r) {
         RETURN_CSTR_ERROR( sqlite3_errmsg(sql) );
@@ -661,8 +1392,18 @@ int vtable_create_connect( sqlite3* sql, void* aux, int argc, const char* const*
         QString geometry_str;
         int geometry_dim, geometry_wkb_type = 0;
         get_geometry_type( new_vtab->provider(), geometry_str, geometry_dim, geometry_wkb_type, srid );
+        // what is needed to declare the table again without opening its source
+        // geometry types that cannot be written in _columns need the source
+        if ( geometry_wkb_type || new_vtab->provider()->geometryType() == QGis::WKBNoGeometry ) {
+            columns_str += QString("INSERT INTO _columns VALUES(%1,'*pk*','%2');").arg(table_id).arg(new_vtab->pk_column());
+            columns_str += QString("INSERT INTO _columns VALUES(%1,'*count*','%2');").arg(table_id).arg(new_vtab->feature_count());
+        }
         if ( geometry_wkb_type ) {
             columns_str += QString("INSERT INTO _columns VALUES(%1,'*geometry*','%2:%3:%4');").arg(table_id).arg(geometry_wkb_type).arg(geometry_dim).arg(srid);
+            // the database may have been initialized without reference systems
+            if ( srid > 0 ) {
+                columns_str += QString( "SELECT InsertEpsgSrid(%1) WHERE NOT EXISTS (SELECT 1 FROM spatial_ref_sys WHERE srid=%1);" ).arg(srid);
+            }
             columns_str += QString( "INSERT OR REPLACE INTO virts_geometry_columns (virt_name, virt_geometry, geometry_type, coord_dimension, srid) "
                                     "VALUES ('%1', 'geometry', %2, %3, %4 );" )
                 .arg(vname.toLower())
@@ -670,11 +1411,11 @@ int vtable_create_connect( sqlite3* sql, void* aux, int argc, const char* const*
                 .arg(geometry_dim)
                 .arg(srid);
             // manually set column statistics (needed for QGIS spatialite provider)
-            QgsRectangle extent = new_vtab->provider()->extent();
+            QgsRectangle extent = new_vtab->extent();
             columns_str += QString("INSERT OR REPLACE INTO virts_geometry_columns_statistics (virt_name, virt_geometry, last_verified, row_count, extent_min_x, extent_min_y, extent_max_x, extent_max_y) "
                                  "VALUES ('%1', 'geometry', datetime('now'), %2, %3, %4, %5, %6);")
                 .arg(vname.toLower())
-                .arg(new_vtab->provider()->featureCount())
+                .arg(new_vtab->feature_count())
                 .arg(extent.xMinimum())
                 .arg(extent.yMinimum())
                 .arg(extent.xMaximum())
@@ -770,9 +1511,292 @@ int vtable_rename( sqlite3_vtab *vtab, const char *new_name )
     return SQLITE_OK;
 }
 
+/**
+ * Index plan built by xBestIndex and passed to xFilter through idxStr
+ *
+ * Format is "colUsed;column:op,column:op,...".
+ * colUsed is the hexadecimal mask of columns read by the query, empty if unknown.
+ * The i-th constraint pair corresponds to the i-th value of xFilter's argv.
+ */
+struct IndexPlan
+{
+    IndexPlan() : hasColUsed(false), colUsed(0) {}
+
+    // whether colUsed is known
+    bool hasColUsed;
+    // mask of used columns (bit 63 stands for all the columns >= 63)
+    quint64 colUsed;
+
+    // (column, sqlite operator) pairs
+    QList<QPair<int, int> > constraints;
+
+    bool isColumnUsed( int column ) const
+    {
+        if ( !hasColUsed ) {
+            return true;
+        }
+        return (colUsed & (Q_UINT64_C(1) << qMin( column, 63 ))) != 0;
+    }
+
+    char* toIdxStr() const
+    {
+        QStringList l;
+        for ( int i = 0; i < constraints.size(); i++ ) {
+            l << QString("%1:%2").arg(constraints[i].first).arg(constraints[i].second);
+        }
+        QString str = (hasColUsed ? QString::number( colUsed, 16 ) : QString()) + ";" + l.join(",");
+        return sqlite3_mprintf( "%s", str.toLocal8Bit().constData() );
+    }
+
+    static IndexPlan fromIdxStr( const char* idxStr )
+    {
+        IndexPlan plan;
+        if ( !idxStr ) {
+            return plan;
+        }
+        QString str( idxStr );
+        int pos = str.indexOf( ';' );
+        if ( pos > 0 ) {
+            plan.colUsed = str.left( pos ).toULongLong( &plan.hasColUsed, 16 );
+        }
+        QStringList l = str.mid( pos + 1 ).split( ",", QString::SkipEmptyParts );
+        foreach ( const QString& c, l ) {
+            QStringList p = c.split( ":" );
+            if ( p.size() == 2 ) {
+                plan.constraints << qMakePair( p[0].toInt(), p[1].toInt() );
+            }
+        }
+        return plan;
+    }
+};
+
+// whether values of a field type are returned to SQLite as numbers (see vtable_column)
+// others, 64 bit integers and booleans included, are returned as text and compared as such
+static bool is_numeric_type( QVariant::Type t )
+{
+    return t == QVariant::Int || t == QVariant::UInt || t == QVariant::Double;
+}
+
+// whether the given sqlite operator can be translated into a QGIS expression
+static bool is_pushable_operator( int op )
+{
+    switch ( op ) {
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+    case SQLITE_INDEX_CONSTRAINT_GT:
+    case SQLITE_INDEX_CONSTRAINT_LE:
+    case SQLITE_INDEX_CONSTRAINT_LT:
+    case SQLITE_INDEX_CONSTRAINT_GE:
+#ifdef SQLITE_INDEX_CONSTRAINT_LIKE
+    case SQLITE_INDEX_CONSTRAINT_LIKE:
+    case SQLITE_INDEX_CONSTRAINT_GLOB:
+#endif
+#ifdef SQLITE_INDEX_CONSTRAINT_NE
+    case SQLITE_INDEX_CONSTRAINT_NE:
+    case SQLITE_INDEX_CONSTRAINT_ISNULL:
+    case SQLITE_INDEX_CONSTRAINT_ISNOTNULL:
+#endif
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Translate a constraint on an attribute into a QGIS expression
+ *
+ * The expression is only used as a pre-filter by the provider, SQLite still checks the constraint
+ * on returned rows. So it must select a superset of what SQLite would select.
+ * An empty string is returned if the constraint cannot be translated safely.
+ */
+static QString constraint_to_expression( const QgsField& field, int op, sqlite3_value* value )
+{
+    QString column = QgsExpression::quotedColumnRef( field.name() );
+#ifdef SQLITE_INDEX_CONSTRAINT_NE
+    if ( op == SQLITE_INDEX_CONSTRAINT_ISNULL ) {
+        return column + " IS NULL";
+    }
+    if ( op == SQLITE_INDEX_CONSTRAINT_ISNOTNULL ) {
+        return column + " IS NOT NULL";
+    }
+#endif
+
+    // only compare values of the same kind, to avoid having to mimic SQLite's affinity rules
+    QString literal;
+    int vtype = sqlite3_value_type( value );
+    if ( vtype == SQLITE_INTEGER && is_numeric_type( field.type() ) ) {
+        literal = QString::number( sqlite3_value_int64( value ) );
+    }
+    else if ( vtype == SQLITE_FLOAT && is_numeric_type( field.type() ) ) {
+        literal = QString::number( sqlite3_value_double( value ), 'g', 17 );
+    }
+    else if ( vtype == SQLITE_TEXT && field.type() == QVariant::String ) {
+        literal = QString::fromUtf8( (const char*)sqlite3_value_text( value ), sqlite3_value_bytes( value ) );
+    }
+    else {
+        return QString();
+    }
+
+    // QGIS compares numeric strings as numbers, and SQL providers use their own collation:
+    // only equality and patterns give a superset for strings
+    bool text = vtype == SQLITE_TEXT;
+    switch ( op ) {
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+        break;
+    case SQLITE_INDEX_CONSTRAINT_GT:
+        return text ? QString() : column + " > " + literal;
+    case SQLITE_INDEX_CONSTRAINT_LE:
+        return text ? QString() : column + " <= " + literal;
+    case SQLITE_INDEX_CONSTRAINT_LT:
+        return text ? QString() : column + " < " + literal;
+    case SQLITE_INDEX_CONSTRAINT_GE:
+        return text ? QString() : column + " >= " + literal;
+#ifdef SQLITE_INDEX_CONSTRAINT_NE
+    case SQLITE_INDEX_CONSTRAINT_NE:
+        return text ? QString() : column + " <> " + literal;
+#endif
+#ifdef SQLITE_INDEX_CONSTRAINT_LIKE
+    case SQLITE_INDEX_CONSTRAINT_LIKE:
+        // SQLite's LIKE has no escape character, but some providers use a backslash as one
+        if ( vtype != SQLITE_TEXT || literal.contains('\\') ) {
+            return QString();
+        }
+        // SQLite's LIKE is case insensitive
+        return column + " ILIKE " + QgsExpression::quotedString( literal );
+    case SQLITE_INDEX_CONSTRAINT_GLOB:
+        if ( vtype != SQLITE_TEXT || literal.contains('[') || literal.contains('\\') ) {
+            return QString();
+        }
+        // literal % and _ become wildcards, which is still a superset
+        literal.replace( '*', '%' ).replace( '?', '_' );
+        return column + " LIKE " + QgsExpression::quotedString( literal );
+#endif
+    default:
+        return QString();
+    }
+    return column + " = " + (vtype == SQLITE_TEXT ? QgsExpression::quotedString( literal ) : literal);
+}
+
+/**
+ * Key of a value in the hash index of a field
+ *
+ * An empty string is returned if the value is not of the same kind as the field,
+ * since SQLite would then apply affinity conversions.
+ */
+static QString hash_index_key( const QgsField& field, sqlite3_value* value )
+{
+    int vtype = sqlite3_value_type( value );
+    if ( field.type() == QVariant::String ) {
+        if ( vtype == SQLITE_TEXT ) {
+            return VLayerHashIndex::stringKey( QString::fromUtf8( (const char*)sqlite3_value_text( value ), sqlite3_value_bytes( value ) ) );
+        }
+    }
+    else if ( vtype == SQLITE_INTEGER ) {
+        return VLayerHashIndex::numberKey( (qint64)sqlite3_value_int64( value ) );
+    }
+    else if ( vtype == SQLITE_FLOAT ) {
+        return VLayerHashIndex::numberKey( sqlite3_value_double( value ) );
+    }
+    return QString();
+}
+
+// Cost model
+// costs are expressed in number of features read from the provider
+// cost of the creation of a provider iterator
+static const double ITERATOR_STARTUP_COST = 10.0;
+// number of features assumed for providers that cannot count them
+static const double UNKNOWN_FEATURE_COUNT = 100000.0;
+// relative cost of a feature evaluated by the provider, but not returned
+static const double PUSHED_DOWN_FILTER_COST = 0.5;
+// lookups on a field before its hash index is built: building it costs about one scan
+static const int HASH_INDEX_MIN_LOOKUPS = 2;
+
+// estimated fraction of rows selected by an attribute constraint
+static double constraint_selectivity( int op )
+{
+    switch ( op ) {
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+        return 0.1;
+    case SQLITE_INDEX_CONSTRAINT_GT:
+    case SQLITE_INDEX_CONSTRAINT_LE:
+    case SQLITE_INDEX_CONSTRAINT_LT:
+    case SQLITE_INDEX_CONSTRAINT_GE:
+        return 0.33;
+#ifdef SQLITE_INDEX_CONSTRAINT_LIKE
+    case SQLITE_INDEX_CONSTRAINT_LIKE:
+    case SQLITE_INDEX_CONSTRAINT_GLOB:
+        return 0.25;
+#endif
+#ifdef SQLITE_INDEX_CONSTRAINT_NE
+    case SQLITE_INDEX_CONSTRAINT_NE:
+    case SQLITE_INDEX_CONSTRAINT_ISNOTNULL:
+        return 0.9;
+    case SQLITE_INDEX_CONSTRAINT_ISNULL:
+        return 0.1;
+#endif
+    }
+    return 1.0;
+}
+
+// estimated fraction of rows selected by a search frame
+static double search_frame_selectivity( VTable* vtab, double n_rows, sqlite3_index_info* index_info, int constraint )
+{
+#if SQLITE_VERSION_NUMBER >= 3038000
+    // the frame is known at planning time if it is a constant
+    sqlite3_value* value = 0;
+    if ( sqlite3_libversion_number() >= 3038000 &&
+         sqlite3_vtab_rhs_value( index_info, constraint, &value ) == SQLITE_OK &&
+         sqlite3_value_type( value ) == SQLITE_BLOB &&
+         sqlite3_value_bytes( value ) >= 39 ) {
+        QgsRectangle frame = spatialite_blob_bbox( (const unsigned char*)sqlite3_value_blob( value ), sqlite3_value_bytes( value ) );
+        QgsRectangle extent = vtab->extent();
+        if ( extent.width() > 0 && extent.height() > 0 ) {
+            QgsRectangle inter = frame.intersect( &extent );
+            return qBound( 0.0, inter.width() * inter.height() / (extent.width() * extent.height()), 1.0 );
+        }
+        return 1.0;
+    }
+#else
+    Q_UNUSED( vtab );
+    Q_UNUSED( index_info );
+    Q_UNUSED( constraint );
+#endif
+    // unknown frame, typically a join probe: assume a small window
+    return 1.0 / sqrt( qMax( n_rows, 1.0 ) );
+}
+
+static void set_estimated_rows( sqlite3_index_info* index_info, double rows, bool unique = false )
+{
+#if SQLITE_VERSION_NUMBER >= 3008002
+    if ( sqlite3_libversion_number() >= 3008002 ) {
+        index_info->estimatedRows = (sqlite3_int64)qMax( rows, 1.0 );
+    }
+#else
+    Q_UNUSED( rows );
+#endif
+#if SQLITE_VERSION_NUMBER >= 3008012
+    if ( unique && sqlite3_libversion_number() >= 3008012 ) {
+        index_info->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+    }
+#else
+    Q_UNUSED( unique );
+#endif
+}
+
 int vtable_bestindex( sqlite3_vtab *pvtab, sqlite3_index_info* index_info )
 {
     VTable *vtab = (VTable*)pvtab;
+    vtab->check_source_changed();
+
+    IndexPlan plan;
+#if SQLITE_VERSION_NUMBER >= 3010000
+    // colUsed is only filled by SQLite >= 3.10
+    if ( sqlite3_libversion_number() >= 3010000 ) {
+        plan.hasColUsed = true;
+        plan.colUsed = index_info->colUsed;
+    }
+#endif
+
+    double n_rows = vtab->feature_count() >= 0 ? vtab->feature_count() : UNKNOWN_FEATURE_COUNT;
+
     for ( int i = 0; i < index_info->nConstraint; i++ ) {
         if ( (index_info->aConstraint[i].usable) &&
              (vtab->pk_column() == index_info->aConstraint[i].iColumn) && 
@@ -781,12 +1805,14 @@ int vtable_bestindex( sqlite3_vtab *pvtab, sqlite3_index_info* index_info )
             index_info->aConstraintUsage[i].argvIndex = 1;
             index_info->aConstraintUsage[i].omit = 1;
             index_info->idxNum = 1; // PK filter
-            index_info->estimatedCost = 1.0; // ??
-            //index_info->estimatedRows = 1;
-            index_info->idxStr = NULL;
-            index_info->needToFreeIdxStr = 0;
+            index_info->estimatedCost = ITERATOR_STARTUP_COST + log2( qMax( n_rows, 2.0 ) );
+            set_estimated_rows( index_info, 1, /* unique */ true );
+            index_info->idxStr = plan.toIdxStr();
+            index_info->needToFreeIdxStr = 1;
             return SQLITE_OK;
         }
+    }
+    for ( int i = 0; i < index_info->nConstraint; i++ ) {
         if ( (index_info->aConstraint[i].usable) &&
              (0 == index_info->aConstraint[i].iColumn) && 
              (index_info->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_EQ) ) {
@@ -795,23 +1821,77 @@ int vtable_bestindex( sqlite3_vtab *pvtab, sqlite3_index_info* index_info )
             // do not test for equality, since it is used for filtering, not to return an actual value
             index_info->aConstraintUsage[i].omit = 1;
             index_info->idxNum = 2; // RTree filter
-            index_info->estimatedCost = 1.0; // ??
-            //index_info->estimatedRows = 1;
-            index_info->idxStr = NULL;
-            index_info->needToFreeIdxStr = 0;
+            double rows = n_rows * search_frame_selectivity( vtab, n_rows, index_info, i );
+            index_info->estimatedCost = ITERATOR_STARTUP_COST + log2( qMax( n_rows, 2.0 ) ) + rows;
+            set_estimated_rows( index_info, rows );
+            index_info->idxStr = plan.toIdxStr();
+            index_info->needToFreeIdxStr = 1;
             return SQLITE_OK;
         }
     }
+
+    int n_attributes = vtab->fields().count();
+    for ( int i = 0; i < index_info->nConstraint; i++ ) {
+        const sqlite3_index_info::sqlite3_index_constraint& c = index_info->aConstraint[i];
+        if ( c.usable && c.iColumn >= 1 && c.iColumn <= n_attributes &&
+             c.op == SQLITE_INDEX_CONSTRAINT_EQ && vtab->can_hash_index( c.iColumn - 1 ) ) {
+            // equality on an attribute, typically a join key: use an in-memory hash index
+            index_info->aConstraintUsage[i].argvIndex = 1;
+            // values of another kind fall back to a scan, let SQLite check the constraint
+            index_info->aConstraintUsage[i].omit = 0;
+            index_info->idxNum = 3; // hash index filter
+            plan.constraints << qMakePair( c.iColumn, (int)c.op );
+            // the index is only built once lookups are repeated, as in a join: until then a lookup is a filtered scan
+            const VLayerHashIndex* index = vtab->hash_index( c.iColumn - 1, /* build */ false );
+            double rows = index && index->size() ? n_rows / index->size() : n_rows * constraint_selectivity( c.op );
+            if ( index ) {
+                index_info->estimatedCost = ITERATOR_STARTUP_COST + log2( qMax( n_rows, 2.0 ) ) + rows;
+            }
+            else {
+                index_info->estimatedCost = ITERATOR_STARTUP_COST + (n_rows - rows) * PUSHED_DOWN_FILTER_COST + rows;
+            }
+            set_estimated_rows( index_info, rows );
+            index_info->idxStr = plan.toIdxStr();
+            index_info->needToFreeIdxStr = 1;
+            return SQLITE_OK;
+        }
+    }
+
+    // no index, but attribute constraints can still be pushed down to the provider
+    double selectivity = 1.0;
+    for ( int i = 0; i < index_info->nConstraint; i++ ) {
+        const sqlite3_index_info::sqlite3_index_constraint& c = index_info->aConstraint[i];
+        if ( !c.usable || c.iColumn < 1 || c.iColumn > n_attributes || !is_pushable_operator( c.op ) ) {
+            continue;
+        }
+        index_info->aConstraintUsage[i].argvIndex = plan.constraints.size() + 1;
+        // the provider filter is only a pre-filter, let SQLite check the constraint
+        index_info->aConstraintUsage[i].omit = 0;
+        plan.constraints << qMakePair( c.iColumn, (int)c.op );
+        selectivity *= constraint_selectivity( c.op );
+    }
+
     index_info->idxNum = 0;
-    index_info->estimatedCost = 10.0;
-    //index_info->estimatedRows = 10;
-    index_info->idxStr = NULL;
-    index_info->needToFreeIdxStr = 0;
+    // full scan, where features discarded by the provider are cheaper than the ones returned
+    double rows = n_rows * selectivity;
+    if ( plan.constraints.isEmpty() ) {
+        index_info->estimatedCost = ITERATOR_STARTUP_COST + n_rows;
+    }
+    else {
+        index_info->estimatedCost = ITERATOR_STARTUP_COST + (n_rows - rows) * PUSHED_DOWN_FILTER_COST + rows;
+    }
+    set_estimated_rows( index_info, rows );
+    index_info->idxStr = plan.toIdxStr();
+    index_info->needToFreeIdxStr = 1;
     return SQLITE_OK;
 }
 
 int vtable_open( sqlite3_vtab *vtab, sqlite3_vtab_cursor **out_cursor )
 {
+    // sources of tables declared from their persisted schema are opened on the first cursor
+    if ( !((VTable*)vtab)->open() ) {
+        return SQLITE_ERROR;
+    }
     VTableCursor *ncursor = new VTableCursor((VTable*)vtab);
     *out_cursor = (sqlite3_vtab_cursor*)ncursor;
     return SQLITE_OK;
@@ -825,22 +1905,158 @@ int vtable_close( sqlite3_vtab_cursor * cursor)
     return SQLITE_OK;
 }
 
+// filter a cursor on the snapshot of its table
+// constraints that are not exact are left to SQLite
+static void vtable_filter_snapshot( VTableCursor* c, QSharedPointer<const VLayerSnapshot> snapshot, int idxNum, const IndexPlan& plan, sqlite3_value **argv )
+{
+    QVector<int> rows;
+    if ( idxNum == 1 ) {
+        // id filter
+        int row = snapshot->row( sqlite3_value_int64( argv[0] ) );
+        if ( row != -1 ) {
+            rows << row;
+        }
+    }
+    else if ( idxNum == 2 ) {
+        // rtree filter
+        const unsigned char* blob = (const unsigned char*)sqlite3_value_blob( argv[0] );
+        if ( blob ) {
+            QgsFeatureIds ids = c->vtab_->spatial_index( snapshot.data() )->intersects( spatialite_blob_bbox( blob, sqlite3_value_bytes( argv[0] ) ) );
+            foreach ( QgsFeatureId id, ids ) {
+                int row = snapshot->row( id );
+                if ( row != -1 ) {
+                    rows << row;
+                }
+            }
+        }
+    }
+    else if ( idxNum == 3 && !plan.constraints.isEmpty() ) {
+        // hash index filter
+        int field = plan.constraints[0].first - 1;
+        QString key = hash_index_key( c->vtab_->fields().at( field ), argv[0] );
+        if ( key.isNull() ) {
+            c->filter_snapshot( snapshot, rows, /* all_rows */ true );
+            return;
+        }
+        QgsFeatureIds ids = c->vtab_->hash_index( field, /* build */ true, snapshot.data() )->lookup( key );
+        foreach ( QgsFeatureId id, ids ) {
+            int row = snapshot->row( id );
+            if ( row != -1 ) {
+                rows << row;
+            }
+        }
+    }
+    else {
+        c->filter_snapshot( snapshot, rows, /* all_rows */ true );
+        return;
+    }
+    // keep the source order
+    qSort( rows );
+    c->filter_snapshot( snapshot, rows, /* all_rows */ false );
+}
+
 int vtable_filter( sqlite3_vtab_cursor * cursor, int idxNum, const char *idxStr, int argc, sqlite3_value **argv )
 {
+    reinterpret_cast<VTableCursor*>(cursor)->vtab_->check_source_changed();
+
+    QSharedPointer<const VLayerSnapshot> snapshot = reinterpret_cast<VTableCursor*>(cursor)->vtab_->snapshot();
+    if ( snapshot ) {
+        vtable_filter_snapshot( reinterpret_cast<VTableCursor*>(cursor), snapshot, idxNum, IndexPlan::fromIdxStr( idxStr ), argv );
+        return SQLITE_OK;
+    }
+
     QgsFeatureRequest request;
     if ( idxNum == 1 ) {
         // id filter
         request.setFilterFid( sqlite3_value_int(argv[0]) );
     }
-    else if ( idxNum == 2 ) {
+    VTableCursor *c = reinterpret_cast<VTableCursor*>(cursor);
+    if ( idxNum == 2 ) {
         // rtree filter
+        // only the MBR is needed, it is read from the blob header
         const unsigned char* blob = (const unsigned char*)sqlite3_value_blob( argv[0] );
         int bytes = sqlite3_value_bytes( argv[0] );
-        std::unique_ptr<QgsGeometry> geom( spatialite_blob_to_qgsgeometry( blob, bytes ) );
-        QgsRectangle r( geom->boundingBox() );
-        request.setFilterRect( r );
+        if ( !blob ) {
+            // NULL search frame: nothing can match
+            c->filter_nothing();
+            return SQLITE_OK;
+        }
+        QgsRectangle r( spatialite_blob_bbox( blob, bytes ) );
+        const VLayerRTree* index = c->vtab_->spatial_index();
+        if ( index ) {
+            // the provider has no spatial index, use ours
+            QgsFeatureIds ids = index->intersects( r );
+            if ( ids.isEmpty() ) {
+                c->filter_nothing();
+                return SQLITE_OK;
+            }
+            request.setFilterFids( ids );
+        }
+        else {
+            request.setFilterRect( r );
+        }
     }
-    VTableCursor *c = reinterpret_cast<VTableCursor*>(cursor);
+    const QgsFields& fields = c->vtab_->fields();
+    IndexPlan plan = IndexPlan::fromIdxStr( idxStr );
+
+    if ( idxNum == 3 && !plan.constraints.isEmpty() ) {
+        // hash index filter
+        int field = plan.constraints[0].first - 1;
+        QString key = hash_index_key( fields.at( field ), argv[0] );
+        bool build = c->vtab_->count_hash_lookup( field ) >= HASH_INDEX_MIN_LOOKUPS;
+        const VLayerHashIndex* index = c->vtab_->hash_index( field, build );
+        if ( !key.isNull() && index ) {
+            QgsFeatureIds ids = index->lookup( key );
+            if ( ids.isEmpty() ) {
+                c->filter_nothing();
+                return SQLITE_OK;
+            }
+            request.setFilterFids( ids );
+        }
+        else if ( !key.isNull() ) {
+            // a single lookup does not pay for the index, the constraint is given to the provider
+            QString e = constraint_to_expression( fields.at( field ), SQLITE_INDEX_CONSTRAINT_EQ, argv[0] );
+            if ( !e.isEmpty() ) {
+                request.setFilterExpression( e );
+            }
+        }
+        // else scan, SQLite checks the constraint
+    }
+
+    if ( idxNum == 0 ) {
+        // attribute constraints, turned into an expression that providers may compile
+        QStringList exprs;
+        for ( int i = 0; i < plan.constraints.size() && i < argc; i++ ) {
+            QString e = constraint_to_expression( fields.at( plan.constraints[i].first - 1 ), plan.constraints[i].second, argv[i] );
+            if ( !e.isEmpty() ) {
+                exprs << e;
+            }
+        }
+        if ( !exprs.isEmpty() ) {
+            request.setFilterExpression( exprs.join( " AND " ) );
+        }
+    }
+
+    if ( plan.hasColUsed ) {
+        // only ask the provider for the columns read by the query
+        QgsAttributeList attributes;
+        for ( int i = 0; i < fields.count(); i++ ) {
+            if ( plan.isColumnUsed( i + 1 ) ) {
+                attributes << i;
+            }
+        }
+        // constraint columns may be needed to evaluate the filter expression
+        for ( int i = 0; i < plan.constraints.size(); i++ ) {
+            if ( !attributes.contains( plan.constraints[i].first - 1 ) ) {
+                attributes << plan.constraints[i].first - 1;
+            }
+        }
+        request.setSubsetOfAttributes( attributes );
+        if ( !plan.isColumnUsed( fields.count() + 1 ) ) {
+            request.setFlags( request.flags() | QgsFeatureRequest::NoGeometry );
+        }
+    }
+
     c->filter( request );
     return SQLITE_OK;
 }
@@ -875,8 +2091,20 @@ int vtable_column( sqlite3_vtab_cursor *cursor, sqlite3_context* ctxt, int idx )
         return SQLITE_OK;
     }
     if ( idx == c->n_columns() + 1) {
-        QPair<unsigned char*, size_t> g = c->current_geometry();
-        sqlite3_result_blob( ctxt, g.first, g.second, delete_geometry_blob );
+        QPair<const unsigned char*, size_t> g = c->current_geometry();
+        if ( !g.first ) {
+            sqlite3_result_null( ctxt );
+        }
+        else {
+            // SQLITE_STATIC cannot be used here: SQLite keeps static values without copying them
+            // (aggregates, sorters), while the buffer is overwritten on the next row.
+            // The copy is done in the output register which keeps its allocation from one row to another.
+            sqlite3_result_blob( ctxt, g.first, g.second, SQLITE_TRANSIENT );
+        }
+        return SQLITE_OK;
+    }
+    if ( c->snapshot() ) {
+        c->snapshot()->resultAttribute( ctxt, c->current_row(), idx - 1 );
         return SQLITE_OK;
     }
     QVariant v = c->current_attribute( idx - 1 );
@@ -46,10 +46,14 @@ int vtable_findfunction( sqlite3_vtab *pVtab,
 }
 
 #include <memory>
+#include <vector>
+#include <stdint.h>
 #include <qgsgeometry.h>
 
 std::unique_ptr<QgsGeometry> spatialite_blob_to_qgsgeometry( const unsigned char* blob, const size_t size );
 
+bool qgsgeometry_to_spatialite_blob( const QgsGeometry& geom, int32_t srid, std::vector<unsigned char>& blob );
+
 void initMetadata( sqlite3* db );
 
 #endif
@@ -0,0 +1,91 @@
+/***************************************************************************
+             vlayer_prefetch.cpp : Read-ahead of source features
+begin                : Oct, 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "vlayer_prefetch.h"
+
+VLayerPrefetcher::VLayerPrefetcher( QSharedPointer<QgsAbstractFeatureSource> source, const QgsFeatureRequest& request ) :
+    source_(source), request_(request), pos_(0), ring_(RING_SIZE), head_(0), count_(0), done_(false), stop_(false)
+{
+}
+
+VLayerPrefetcher::~VLayerPrefetcher()
+{
+    {
+        QMutexLocker lock( &mutex_ );
+        stop_ = true;
+        not_full_.wakeAll();
+    }
+    wait();
+}
+
+bool VLayerPrefetcher::nextFeature( QgsFeature& f )
+{
+    if ( pos_ >= current_.size() ) {
+        // take the next batch
+        QMutexLocker lock( &mutex_ );
+        while ( count_ == 0 && !done_ ) {
+            not_empty_.wait( &mutex_ );
+        }
+        if ( count_ == 0 ) {
+            return false;
+        }
+        current_.clear();
+        qSwap( current_, ring_[head_] );
+        head_ = (head_ + 1) % RING_SIZE;
+        count_--;
+        pos_ = 0;
+        not_full_.wakeOne();
+    }
+    f = current_[pos_++];
+    return true;
+}
+
+void VLayerPrefetcher::run()
+{
+    QgsFeatureIterator it = source_->getFeatures( request_ );
+    QVector<QgsFeature> batch;
+    batch.reserve( BATCH_SIZE );
+    QgsFeature f;
+    bool more = true;
+    while ( more ) {
+        more = it.nextFeature( f );
+        if ( more ) {
+            batch << f;
+            if ( batch.size() < BATCH_SIZE ) {
+                continue;
+            }
+        }
+
+        QMutexLocker lock( &mutex_ );
+        while ( count_ == RING_SIZE && !stop_ ) {
+            not_full_.wait( &mutex_ );
+        }
+        if ( stop_ ) {
+            break;
+        }
+        if ( !batch.isEmpty() ) {
+            qSwap( ring_[(head_ + count_) % RING_SIZE], batch );
+            count_++;
+            batch.clear();
+            batch.reserve( BATCH_SIZE );
+        }
+        if ( !more ) {
+            done_ = true;
+        }
+        not_empty_.wakeOne();
+    }
+    it.close();
+}
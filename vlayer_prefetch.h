@@ -0,0 +1,75 @@
+/***************************************************************************
+             vlayer_prefetch.h : Read-ahead of source features
+begin                : Oct, 2015
+copyright            : (C) 2015 Hugo Mercier, Oslandia
+email                : hugo dot mercier at oslandia dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef QGSVIRTUAL_LAYER_PREFETCH_H
+#define QGSVIRTUAL_LAYER_PREFETCH_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QVector>
+#include <QSharedPointer>
+
+#include <qgsfeature.h>
+#include <qgsfeatureiterator.h>
+#include <qgsfeaturerequest.h>
+
+/**
+ * Read the features of a request in a worker thread, ahead of their consumer
+ *
+ * Features are passed in batches through a bounded ring buffer, with a single
+ * producer (the worker) and a single consumer (the cursor).
+ * The feature source must be safe to use from another thread.
+ */
+class VLayerPrefetcher : public QThread
+{
+public:
+    //! Number of features per batch
+    static const int BATCH_SIZE = 64;
+    //! Number of batches the worker may read ahead
+    static const int RING_SIZE = 16;
+
+    VLayerPrefetcher( QSharedPointer<QgsAbstractFeatureSource> source, const QgsFeatureRequest& request );
+
+    //! Stop the worker and wait for it
+    ~VLayerPrefetcher();
+
+    //! Next feature, returns false at the end
+    bool nextFeature( QgsFeature& f );
+
+protected:
+    void run() override;
+
+private:
+    QSharedPointer<QgsAbstractFeatureSource> source_;
+    QgsFeatureRequest request_;
+
+    // batch being read by the consumer
+    QVector<QgsFeature> current_;
+    int pos_;
+
+    // shared state, protected by mutex_
+    QMutex mutex_;
+    QWaitCondition not_empty_;
+    QWaitCondition not_full_;
+    QVector<QVector<QgsFeature> > ring_;
+    int head_;
+    int count_;
+    bool done_;
+    bool stop_;
+};
+
+#endif